@@ -1,11 +1,33 @@
 #!/bin/bash
 
-CXX=g++
-CC=gcc
+# GCC 11 or newer: std::to_chars and std::from_chars of doubles (<charconv>)
+CXX=${CXX:-g++}
+CC=${CC:-gcc}
 
 CXXFLAGS="-O3 -g -std=c++17 -Wall -Wextra -Wshadow -Wcast-qual -Wcast-align -Wswitch-enum -Wundef -pedantic"
 CCFLAGS="-O3 -std=c99 -Wall -Wextra -Wshadow -Wcast-qual -Wcast-align -Wstrict-prototypes -Wstrict-aliasing=1 -Wswitch-enum -Wundef -pedantic"
 
+if ! printf '#include <charconv>\nvoid f(char* b, double& d) { std::from_chars(b, b + 8, d); std::to_chars(b, b + 8, d); }\n' | $CXX -std=c++17 -fsyntax-only -x c++ - > /dev/null 2>&1; then
+	echo "$CXX has no std::to_chars / std::from_chars for doubles: GCC 11 or newer is needed" >&2
+	exit 1
+fi
+
+# compressed input, when the libraries are installed
+LIBS=""
+if echo "#include <zlib.h>" | $CXX -E -x c++ - > /dev/null 2>&1; then
+	CXXFLAGS="$CXXFLAGS -DAGGREGATE_WITH_ZLIB"
+	LIBS="$LIBS -lz"
+fi
+if echo "#include <zstd.h>" | $CXX -E -x c++ - > /dev/null 2>&1; then
+	CXXFLAGS="$CXXFLAGS -DAGGREGATE_WITH_ZSTD"
+	LIBS="$LIBS -lzstd"
+fi
+
+# io_uring is used with its system calls, the kernel header is enough
+if echo "#include <linux/io_uring.h>" | $CXX -E -x c++ - > /dev/null 2>&1; then
+	CXXFLAGS="$CXXFLAGS -DAGGREGATE_WITH_URING"
+fi
+
 $CC $CCFLAGS -c xxHash/xxhash.c
-$CXX $CXXFLAGS src/aggregate.cpp xxhash.o -IxxHash/ -I/opt/boost/boost_1_62_0/include -o aggregate -lboost_system -lboost_filesystem -lpthread
+$CXX $CXXFLAGS src/aggregate.cpp xxhash.o -IxxHash/ -I/opt/boost/boost_1_62_0/include -o aggregate -lboost_system -lboost_filesystem -lpthread$LIBS
 
@@ -0,0 +1,174 @@
+#ifndef AGGREGATE_ACCUMULATORS_H
+#define AGGREGATE_ACCUMULATORS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+/*
+ *  Aggregates of the groups, as columns indexed by the group id: each of the width slots is an
+ *  array of int64_t with a bitmap (bit g) telling which groups have seen at least a valid value.
+ *  A row comes with its width values and a mask_width words bitmap of the valid ones.
+ *  The slots are sorted by how they merge: first the integer ones that add (sums, also of
+ *  fixed point decimals, and counts), the double sums, then the minimums and the maximums,
+ *  each range with its own loop.
+ *  A double sum holds the bits of the double, followed by its compensation when the sums are
+ *  compensated (Neumaier's variant of Kahan summation); a double minimum or maximum holds
+ *  order_bits of the double, so that it's compared as an integer.
+ *  An invalid value is stored as the neutral element of its slot (0, or the largest / smallest
+ *  int64_t for a minimum / maximum) with its bit cleared, so merging has no branches.
+ */
+
+
+// the layout of the slots: [0, reals) add, [reals, mins) add as doubles, [mins, maxs) keep the
+// minimum, [maxs, width) the maximum
+struct slots_t
+{
+	size_t width{0};
+	size_t reals{0};
+	size_t mins{0};
+	size_t maxs{0};
+	bool compensated{false};   // the double sums are (sum, compensation) pairs
+};
+
+
+inline int64_t double_bits(double d)
+{
+	int64_t i;
+	std::memcpy(&i, &d, sizeof(i));
+	return i;
+}
+
+
+inline double bits_double(int64_t i)
+{
+	double d;
+	std::memcpy(&d, &i, sizeof(d));
+	return d;
+}
+
+
+// the bits of d, flipped for the negatives so that the integers sort as the doubles
+inline int64_t order_bits(double d)
+{
+	const int64_t i = double_bits(d);
+	return i ^ ((i >> 63) & std::numeric_limits<int64_t>::max());
+}
+
+
+inline double order_double(int64_t i)
+{
+	return bits_double(i ^ ((i >> 63) & std::numeric_limits<int64_t>::max()));
+}
+
+
+class SumTable
+{
+public:
+	SumTable() = default;
+	explicit SumTable(const slots_t& slots)
+		: _slots(slots)
+		, _width(slots.width)
+		, _mask_width((slots.width + 63) / 64)
+		, _sums(slots.width)
+		, _valid(slots.width)
+	{}
+
+	size_t width() const { return _width; }
+	size_t mask_width() const { return _mask_width; }
+	size_t size() const { return _size; }
+
+	size_t memory() const
+	{
+		size_t n{0};
+		for (size_t j = 0; j < _width; j++)
+			n += _sums[j].capacity() * sizeof(int64_t) + _valid[j].capacity() * sizeof(uint64_t);
+		return n;
+	}
+
+	void reserve(size_t groups)
+	{
+		for (size_t j = 0; j < _width; j++)
+		{
+			_sums[j].reserve(groups);
+			_valid[j].reserve((groups + 63) / 64);
+		}
+	}
+
+	// add a group with the values v (and the validity bitmap m)
+	void push(const int64_t* v, const uint64_t* m)
+	{
+		const size_t g = _size++;
+		for (size_t j = 0; j < _width; j++)
+		{
+			_sums[j].push_back(v[j]);
+			if (g % 64 == 0)
+				_valid[j].push_back(0);
+			_valid[j][g / 64] |= bit(m, j) << (g % 64);
+		}
+	}
+
+	// add the values v (and the validity bitmap m) to the group g
+	void add(size_t g, const int64_t* v, const uint64_t* m)
+	{
+		for (size_t j = 0; j < _slots.reals; j++)
+			_sums[j][g] += v[j];
+		if (_slots.compensated)
+		{
+			for (size_t j = _slots.reals; j < _slots.mins; j += 2)
+				add_compensated(_sums[j][g], _sums[j + 1][g], v + j);
+		}
+		else
+		{
+			for (size_t j = _slots.reals; j < _slots.mins; j++)
+				_sums[j][g] = double_bits(bits_double(_sums[j][g]) + bits_double(v[j]));
+		}
+		for (size_t j = _slots.mins; j < _slots.maxs; j++)
+			_sums[j][g] = std::min(_sums[j][g], v[j]);
+		for (size_t j = _slots.maxs; j < _width; j++)
+			_sums[j][g] = std::max(_sums[j][g], v[j]);
+
+		for (size_t j = 0; j < _width; j++)
+			_valid[j][g / 64] |= bit(m, j) << (g % 64);
+	}
+
+	// the values of the group g in v and their validity bitmap in m, as a row
+	void get(size_t g, int64_t* v, uint64_t* m) const
+	{
+		std::fill(m, m + _mask_width, 0);
+		for (size_t j = 0; j < _width; j++)
+		{
+			v[j] = _sums[j][g];
+			m[j / 64] |= ((_valid[j][g / 64] >> (g % 64)) & 1) << (j % 64);
+		}
+	}
+
+	int64_t value(size_t g, size_t j) const { return _sums[j][g]; }
+	bool valid(size_t g, size_t j) const { return (_valid[j][g / 64] >> (g % 64)) & 1; }
+
+private:
+	static uint64_t bit(const uint64_t* m, size_t j) { return (m[j / 64] >> (j % 64)) & 1; }
+
+	// (sum, c) += (v[0], v[1]): the compensation collects the low bits lost by the sum
+	static void add_compensated(int64_t& sum, int64_t& c, const int64_t* v)
+	{
+		const double a = bits_double(sum);
+		const double b = bits_double(v[0]);
+		const double t = a + b;
+		const double e = (std::fabs(a) >= std::fabs(b)) ? (a - t) + b : (b - t) + a;
+		sum = double_bits(t);
+		c = double_bits(bits_double(c) + e + bits_double(v[1]));
+	}
+
+	slots_t _slots;
+	size_t _width{0};
+	size_t _mask_width{0};
+	size_t _size{0};
+	std::vector<std::vector<int64_t>> _sums;    // per slot
+	std::vector<std::vector<uint64_t>> _valid;  // per slot
+};
+
+#endif
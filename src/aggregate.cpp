@@ -1,16 +1,38 @@
 #include <iostream>
 
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
 #include <vector>
 #include <map>
-#include <unordered_map>
+#include <set>
+#include <array>
 #include <fstream>
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/utility/string_view.hpp>
 //#include <experimental/string_view>
+#define XXH_INLINE_ALL
 #include <xxhash.h>
 
+#include "simd.h"
+#include "tokenizer.h"
+#include "groups.h"
+#include "dense_keys.h"
+#include "dictionary.h"
+#include "spill.h"
+#include "writer.h"
+#include "compressed.h"
+#include "input.h"
+#include "column_cache.h"
+
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -29,26 +51,52 @@ using namespace std;
 //namespace std_exp = std::experimental;
 
 
-typedef pair<int64_t, bool> pval_t;
-
-template <typename T>
-struct mapval_t
-{
-	std::vector<std::pair<T, bool>> sum_val;
-	std::vector<std::string> key_val;
-};
-
-
 class Reader
 {
 public:
-	Reader(const std::string& fname)
+	// read the lines starting inside [range_begin, range_end): the last one may end beyond range_end;
+	// populate reads the pages up front instead of at their first access: the whole file when
+	// the range is all of it and fits in a window (0 = no window), otherwise see populate()
+	Reader(const std::string& fname, size_t range_begin = 0, size_t range_end = std::string::npos, bool populate = false, size_t window = 0)
 	{
 		struct stat sb;
-		int fd = open(fname.c_str(), O_RDONLY);
-		fstat(fd, &sb);
+		fd = open(fname.c_str(), O_RDONLY);
+		if (fd < 0 || fstat(fd, &sb) != 0)
+		{
+			std::cerr << "Error reading " << fname << ": " << strerror(errno) << std::endl;
+			exit(1);
+		}
 		fsize = sb.st_size;
-		addr = static_cast<char*>(mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+
+		p_end = std::min(range_end, fsize);
+		if (fsize > 0)
+		{
+			const bool whole = populate && range_begin == 0 && p_end == fsize && (window == 0 || fsize <= window);
+			void* p = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE | (whole ? MAP_POPULATE : 0), fd, 0);
+			if (p == MAP_FAILED)
+			{
+				std::cerr << "Error mapping " << fname << ": " << strerror(errno) << std::endl;
+				exit(1);
+			}
+			addr = static_cast<char*>(p);
+			madvise(addr, fsize, MADV_SEQUENTIAL);
+			populating = populate && !whole;
+		}
+
+		if (range_begin > 0 && range_begin < p_end)
+		{
+			// align to the first line that starts inside the range
+			p_buffer = range_begin - 1;
+			const auto end_line_pos = get_end_line();
+			if (end_line_pos != std::string::npos)
+				p_buffer = end_line_pos + 1;
+		}
+		else
+			p_buffer = range_begin;
+		released = p_buffer & ~(page_size() - 1);
+
+		if (p_buffer >= p_end)
+			end_reached = true;
 	}
 
 	boost::string_view get_line()
@@ -62,6 +110,8 @@ public:
 			const auto diff = end_line_pos - p_buffer;
 			boost::string_view r = boost::string_view(&addr[p_buffer], diff);
 			p_buffer += diff+1;
+			if (p_buffer >= p_end)
+				end_reached = true;
 			return r;
 		}
 		else
@@ -70,80 +120,215 @@ public:
 		}
 	}
 
+	// the unread part of the file: the lines of the range are the ones starting in the first range_left() bytes
+	boost::string_view get_remaining() const
+	{
+		if (addr == nullptr || end_reached)
+			return "";
+		return boost::string_view(&addr[p_buffer], fsize - p_buffer);
+	}
+
+	size_t range_left() const { return end_reached ? 0 : p_end - p_buffer; }
+
 	bool is_finished() const { return end_reached; }
+	bool at_file_head() const { return p_buffer == 0; }
 	
-	~Reader() { munmap(addr, fsize); }
+	// with populate, the pages of the n bytes after the first consumed of get_remaining() are
+	// mapped at once, before they are parsed
+	void populate(size_t consumed, size_t n)
+	{
+		const size_t b = (p_buffer + consumed) & ~(page_size() - 1);
+		const size_t e = std::min(p_buffer + consumed + n, fsize);
+		if (!populating || b >= e)
+			return;
+
+#ifdef MADV_POPULATE_READ
+		if (madvise(addr + b, e - b, MADV_POPULATE_READ) == 0)
+			return;
+#endif
+		madvise(addr + b, e - b, MADV_WILLNEED);
+	}
+
+	// the pages before the first consumed bytes of get_remaining() are not needed anymore: they
+	// leave the memory of the process and, with drop_cache, the page cache
+	void release(size_t consumed, bool drop_cache)
+	{
+		const size_t e = std::min(p_buffer + consumed, fsize) & ~(page_size() - 1);
+		if (addr == nullptr || e <= released)
+			return;
+
+		madvise(addr + released, e - released, MADV_DONTNEED);
+		if (drop_cache)
+			posix_fadvise(fd, released, e - released, POSIX_FADV_DONTNEED);
+		released = e;
+	}
+
+	~Reader()
+	{
+		if (addr != nullptr)
+			munmap(addr, fsize);
+		close(fd);
+	}
 
 private:
 	inline size_t get_end_line()
 	{
-		for (size_t i = p_buffer; i < fsize; i++)
-			if (addr[i] == end_line)
-				return i;
+		const size_t i = simd::find(addr, p_buffer, fsize, end_line);
+		if (i != fsize)
+			return i;
 
 		end_reached = true;
 		return std::string::npos;
 	}
 
+	static size_t page_size()
+	{
+		static const size_t size = sysconf(_SC_PAGESIZE);
+		return size;
+	}
+
+	int fd{-1};
 	char* addr{nullptr};
 	size_t fsize;
 	size_t p_buffer{0};
+	size_t p_end;
 
 	bool end_reached{false};
+	bool populating{false};   // a window at a time
+	size_t released{0};   // the pages before are released
 	constexpr const static char end_line{'\n'};
 };
 
-inline
-std::vector<boost::string_view> split(const boost::string_view& line, char sep)
+
+// a newline-aligned slice of an input file handled by a single thread (a range of row groups
+// for a file read from its cache)
+struct chunk_t
 {
-	static size_t reservation = 0;
-	std::vector<boost::string_view> v;
-	if (reservation != 0)
-		v.reserve(reservation);
+	size_t file;
+	size_t begin;
+	size_t end;
+};
+
 
-	const size_t l = line.length();
-	size_t last = 0, i = 0, c = 0;
-	for (; i < l; i++)
+std::vector<chunk_t> get_chunks(const std::vector<std::string>& fnames, const std::vector<std::unique_ptr<ColumnCache>>& caches, size_t threads, size_t chunk_size)
+{
+	std::vector<chunk_t> chunks;
+	for (size_t f = 0; f < fnames.size(); f++)
 	{
-		if (line[i] == sep)
+		if (caches[f])
 		{
-			v.push_back(boost::string_view(&line[last], (i - last)));
-			i++;
-			last = i;
-			c++;
+			const size_t groups = caches[f]->groups();
+			size_t n = 1;
+			if (threads > 1 && chunk_size > 0)
+				n = std::max<size_t>(1, std::min({threads, groups, caches[f]->bytes() / chunk_size}));
+
+			for (size_t c = 0; c < n; c++)
+				chunks.push_back({f, c * groups / n, (c + 1) * groups / n});
+			continue;
 		}
+
+		const size_t fsize = file_size(fnames[f]);
+		size_t n = 1;
+		// a compressed file can only be read from its start
+		if (threads > 1 && chunk_size > 0 && compression_of(fnames[f]) == compression_t::none)
+			n = std::max<size_t>(1, std::min(threads, fsize / chunk_size));
+
+		const size_t step = fsize / n;
+		for (size_t c = 0; c < n; c++)
+			chunks.push_back({f, c * step, (c + 1 == n) ? std::string::npos : (c + 1) * step});
 	}
 
-	//std::cerr << "last: " << last << ", i = " << i << std::endl;
-	if (i - last > 1)
-		v.push_back(boost::string_view(&line[last], (i - last)));
-	else
-		v.push_back(boost::string_view(""));
+	return chunks;
+}
+
+
+// how the input files are read
+struct input_options_t
+{
+	io_backend_t io{io_backend_t::automatic};
+	size_t io_depth{4};
+	size_t decompress_threads{1};
+	size_t window{64 * 1024 * 1024};   // 0 = the whole range at once
+	bool drop_cache{false};
+};
+
+
+// the lines of the blocks of a reader (compressed or pread): the lines to skip are at the start
+// of the first blocks, and limit is the position (in the data read) where the last line starts
+template <typename R, typename F>
+void block_splitter(R& reader, const string& separator, F& fun, size_t skip_line, size_t needed_fields, size_t limit)
+{
+	const Tokenizer tokenizer{separator[0], needed_fields};
+	std::vector<uint32_t> field_ends;
 
-	reservation = c + 1;
-	return v;
+	size_t consumed{0};
+	boost::string_view block;
+	while (consumed < limit && reader.next(block))
+	{
+		const size_t size = block.size();
+		for (; skip_line > 0 && !block.empty(); skip_line--)
+		{
+			const auto p = block.find('\n');
+			block.remove_prefix(p == boost::string_view::npos ? block.size() : p + 1);
+		}
+
+		const size_t stop = std::min<size_t>(block.size(), limit - consumed);
+		tokenizer.tokenize(block.data(), block.size(), stop, field_ends, fun);
+		consumed += size;
+	}
 }
 
 
 template <typename F>
-void splitter(const string& fname, const string& separator, F fun, size_t skip_line)
+void splitter(const string& fname, const string& separator, F fun, size_t skip_line, size_t needed_fields = 0, size_t range_begin = 0, size_t range_end = std::string::npos, const input_options_t& input = input_options_t{})
 {
-	Reader reader{fname};
+	// the range of a compressed file is in the decompressed data
+	if (compression_of(fname) != compression_t::none)
+	{
+		CompressedReader reader{fname, input.decompress_threads};
+		block_splitter(reader, separator, fun, skip_line, needed_fields, range_end);
+		return;
+	}
+
+	const auto io = choose_io(fname, file_size(fname), input.io);
+	if (io == io_backend_t::pread || io == io_backend_t::uring)
+	{
+		PreadReader reader{fname, range_begin, range_end, input.io_depth, input.drop_cache, io == io_backend_t::uring};
+		block_splitter(reader, separator, fun, reader.at_file_head() ? skip_line : 0, needed_fields, std::string::npos);
+		return;
+	}
+
+	Reader reader{fname, range_begin, range_end, io == io_backend_t::populate, input.window};
 	size_t skipped{0};
 
+	// only the head of the file has lines to skip
+	if (!reader.at_file_head())
+		skip_line = 0;
+
 	while (!reader.is_finished() && skipped < skip_line)
 	{
 		reader.get_line();
 		skipped++;
 	}
 
-	while (!reader.is_finished())
+	const Tokenizer tokenizer{separator[0], needed_fields};
+	std::vector<uint32_t> field_ends;
+	const auto data = reader.get_remaining();
+	const size_t left = reader.range_left();
+
+	// a window at a time (populated first), releasing the pages of the lines done: a line
+	// crossing the end of a window belongs to it, and the next one starts after it
+	size_t done{0};
+	while (done < left)
 	{
-		const boost::string_view line = reader.get_line();
-		if (line.empty())
-			continue;
+		const size_t stop = (input.window == 0) ? left - done : std::min(input.window, left - done);
+		reader.populate(done, stop);
+		const size_t n = tokenizer.tokenize(data.data() + done, data.size() - done, stop, field_ends, fun);
+		if (n == 0)
+			break;
 
-		fun(split(line, separator[0]));
+		done += n;
+		reader.release(done, input.drop_cache);
 	}
 }
 
@@ -177,6 +362,21 @@ std::map<uint32_t, uint32_t> get_index_uint32(const string& index)
 }
 
 
+// the columns of an index in the order of the list
+std::vector<uint32_t> get_columns(const std::map<uint32_t, uint32_t>& index)
+{
+	std::vector<std::pair<uint32_t, uint32_t>> pos;
+	for (const auto& i : index)
+		pos.emplace_back(i.second, i.first);
+	std::sort(pos.begin(), pos.end());
+
+	std::vector<uint32_t> columns;
+	for (const auto& p : pos)
+		columns.push_back(p.second);
+	return columns;
+}
+
+
 std::vector<std::string> get_index_string(const std::string& index)
 {
 	vector<string> indexs;
@@ -185,94 +385,982 @@ std::vector<std::string> get_index_string(const std::string& index)
 	vector<string> k_strs;
 	boost::split(k_strs, index, sep);
 
-	for(const auto& k : k_strs)
+	for(const auto& f : k_strs)
 	{
+		// an aggregate fn:range is expanded to fn:column for every column
+		const auto c = f.find(":");
+		const string fn = (c == string::npos) ? "" : f.substr(0, c + 1);
+		const string k = (c == string::npos) ? f : f.substr(c + 1);
+
 		auto p = k.find("-");
 		if(p != string::npos)
 		{
 			const auto b = stoull(k.substr(0, p));
 			const auto e = stoull(k.substr(p+1));
 			for(size_t n = b; n <= e; n++)
-				indexs.push_back(std::to_string(n));
+				indexs.push_back(fn + std::to_string(n));
 		}
 		else
-			indexs.push_back(k);
+			indexs.push_back(fn + k);
 	}
 
 	return indexs;
 }
 
 
-class BuildKey
+// how a value column is parsed: integer, fixed point decimal with scale digits, or double
+struct column_type_t
 {
-public:
-	BuildKey(const std::map<uint32_t, uint32_t>& key_index) : _key_index(key_index)
+	enum kind_t : uint8_t { integer, fixed, real };
+
+	kind_t kind{integer};
+	uint8_t scale{0};
+};
+
+
+// the aggregates of the -s list, a slot each: the slots are sorted by function (see slots_t)
+// so that every function is computed by its own loop
+struct aggregates_t
+{
+	enum kind_t : uint8_t { sum, rows, count, real_sum, min, max };
+
+	struct slot_t
+	{
+		kind_t kind;
+		uint32_t column;
+		uint32_t input;   // index of the column in inputs
+	};
+
+	std::vector<slot_t> slots;
+	std::map<uint32_t, uint32_t> inputs;   // the columns to parse, each once
+	std::vector<column_type_t> types;      // of every input
+	bool compensated{false};               // a real_sum takes two slots, sum and compensation
+
+	size_t size() const { return slots.size(); }
+
+	// the aggregates of the list, a compensated sum counted once
+	size_t functions() const
+	{
+		return compensated ? slots.size() - (first(min) - first(real_sum)) / 2 : slots.size();
+	}
+
+	// first slot of the function k (or of the ones after it)
+	size_t first(kind_t k) const
+	{
+		size_t i{0};
+		while (i < slots.size() && slots[i].kind < k)
+			i++;
+		return i;
+	}
+
+	slots_t layout() const { return {slots.size(), first(real_sum), first(min), first(max), compensated}; }
+
+	column_type_t type_of(uint32_t column) const
+	{
+		const auto it = inputs.find(column);
+		return it == inputs.end() ? column_type_t{} : types[it->second];
+	}
+
+	// the slot of the function k on column (the sum of a double column is a real_sum)
+	uint32_t find(kind_t k, uint32_t column) const
+	{
+		if (k == sum && type_of(column).kind == column_type_t::real)
+			k = real_sum;
+
+		for (size_t i = 0; i < slots.size(); i++)
+			if (slots[i].kind == k && (k == rows || slots[i].column == column))
+				return static_cast<uint32_t>(i);
+		return npos;
+	}
+
+	// the function of a name: count without a column counts the rows
+	static bool kind_of(const std::string& name, bool has_column, kind_t& k)
+	{
+		if (name == "sum") k = sum;
+		else if (name == "count") k = has_column ? count : rows;
+		else if (name == "min") k = min;
+		else if (name == "max") k = max;
+		else return false;
+		return true;
+	}
+
+	constexpr static uint32_t npos{std::numeric_limits<uint32_t>::max()};
+};
+
+
+// the -s list: a column (its sum), fn:columns with fn in sum, count, min, max, avg, or count.
+// types are the columns that are not integers, compensated asks for compensated double sums
+aggregates_t get_aggregates(const string& list, const std::map<uint32_t, column_type_t>& types, bool compensated)
+{
+	auto type_of = [&types](uint32_t c) {
+		const auto it = types.find(c);
+		return it == types.end() ? column_type_t{} : it->second;
+	};
+	auto sum_of = [&type_of](uint32_t c) {
+		return type_of(c).kind == column_type_t::real ? aggregates_t::real_sum : aggregates_t::sum;
+	};
+
+	std::set<std::pair<aggregates_t::kind_t, uint32_t>> specs;
+	std::vector<std::string> strs;
+	boost::split(strs, list, boost::is_any_of(";"));
+
+	for (const auto& e : strs)
 	{
-		state = XXH64_createState();
+		const auto p = e.find(":");
+		const string name = (p == string::npos) ? (e == "count" ? e : "sum") : e.substr(0, p);
+		const string columns = (p == string::npos) ? (e == "count" ? "" : e) : e.substr(p + 1);
+
+		aggregates_t::kind_t k;
+		if (name == "avg")
+		{
+			for (const auto& c : get_index_uint32(columns))
+			{
+				specs.emplace(sum_of(c.first), c.first);
+				specs.emplace(aggregates_t::count, c.first);
+			}
+		}
+		else if (!aggregates_t::kind_of(name, !columns.empty(), k))
+		{
+			std::cerr << "Unknown aggregate function: " << name << std::endl;
+			exit(1);
+		}
+		else if (k == aggregates_t::rows)
+			specs.emplace(k, 0);
+		else
+		{
+			for (const auto& c : get_index_uint32(columns))
+				specs.emplace(k == aggregates_t::sum ? sum_of(c.first) : k, c.first);
+		}
 	}
 
-	uint64_t hash(const std::vector<boost::string_view>& line)
+	aggregates_t aggregates;
+	aggregates.compensated = compensated;
+	for (const auto& s : specs)
 	{
-		XXH64_reset(state, 0);
-		for (const auto k : _key_index)
-			XXH64_update(state, line[k.first].data(), line[k.first].size());
-		return XXH64_digest(state);
+		uint32_t input{0};
+		if (s.first != aggregates_t::rows)
+		{
+			const auto r = aggregates.inputs.emplace(s.second, static_cast<uint32_t>(aggregates.inputs.size()));
+			if (r.second)
+				aggregates.types.push_back(type_of(s.second));
+			input = r.first->second;
+		}
+		aggregates.slots.push_back({s.first, s.second, input});
+		if (s.first == aggregates_t::real_sum && compensated)
+			aggregates.slots.push_back({s.first, s.second, input});
 	}
+	return aggregates;
+}
+
 
-	~BuildKey()
+// hash of the composite key: every field is hashed alone (XXH3 with its position as seed,
+// so its length counts too) and the field hashes are chained, so ("ab","c") != ("a","bc")
+class BuildKey
+{
+public:
+	BuildKey(const std::vector<uint32_t>& columns) : _columns(columns) {}
+
+	uint64_t hash(const row_t& line) const
 	{
-		XXH64_freeState(state);
+		switch (_columns.size())
+		{
+			case 1:
+				return field(line, 0);
+			case 2:
+				return hash_combine(field(line, 0), field(line, 1));
+			case 3:
+				return hash_combine(hash_combine(field(line, 0), field(line, 1)), field(line, 2));
+			case 4:
+				return hash_combine(hash_combine(hash_combine(field(line, 0), field(line, 1)), field(line, 2)), field(line, 3));
+			default:
+			{
+				uint64_t h = field(line, 0);
+				for (size_t i = 1; i < _columns.size(); i++)
+					h = hash_combine(h, field(line, i));
+				return h;
+			}
+		}
 	}
 
 private:
-	XXH64_state_t* state;
-	const std::map<uint32_t, uint32_t>& _key_index;
+	inline uint64_t field(const row_t& line, size_t i) const
+	{
+		const auto f = line[_columns[i]];
+		return XXH3_64bits_withSeed(f.data(), f.size(), i);
+	}
+
+	std::vector<uint32_t> _columns;
 };
 
 
-int64_t fast_atol(const boost::string_view& str)
+// parse str in val (8 digits at time); false when str is not a valid int64_t. An empty str is 0
+inline bool fast_atol(const boost::string_view& str, int64_t& val)
 {
-	size_t i;
-	int64_t val{};
-	const size_t l{str.length()};
+	const char* p = str.data();
+	size_t l{str.length()};
 	bool negative{false};
 
-	if (l == 0) return 0;
+	val = 0;
+	if (l == 0) return true;
 
 	switch(str[0])
 	{
 		case '-':
 		{
-			i = 1;
+			p++; l--;
 			negative = true;
 			break;
 		}
 		case '+':
 		{
-			i = 1;
+			p++; l--;
 			break;
 		}
 		default:
+			break;
+	}
+
+	// no digits or more than int64_t can hold
+	if (l == 0 || l > 19)
+		return false;
+
+	const size_t head = (l % 8 == 0) ? 8 : l % 8;
+	uint64_t c = simd::load_digits(p, head);
+	bool ok = simd::is_digits(c);
+	uint64_t u = simd::digits_value(c);
+
+	for (p += head, l -= head; l > 0; p += 8, l -= 8)
+	{
+		std::memcpy(&c, p, sizeof(c));
+		ok &= simd::is_digits(c);
+		u = u * 100000000 + simd::digits_value(c);
+	}
+
+	ok &= (u <= static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) + negative);
+	val = static_cast<int64_t>(negative ? 0 - u : u);
+	return ok;
+}
+
+
+// parse the decimal str in val as an integer with scale decimals (the other ones round half away
+// from zero); false when str is not a decimal or val can't hold it. An empty str is 0
+inline bool fast_atofixed(const boost::string_view& str, unsigned scale, int64_t& val)
+{
+	const size_t dot = str.find('.');
+	const auto integer = str.substr(0, dot);
+	const auto fraction = (dot == boost::string_view::npos) ? boost::string_view{} : str.substr(dot + 1);
+
+	int64_t i;
+	if (!fast_atol(integer, i))
+		return false;
+
+	uint64_t f{0}, p{1};
+	bool ok{true};
+	for (size_t k = 0; k < scale; k++)
+	{
+		const unsigned d = (k < fraction.size()) ? static_cast<unsigned char>(fraction[k]) - '0' : 0;
+		ok &= (d <= 9);
+		f = f * 10 + d;
+		p *= 10;
+	}
+	for (size_t k = scale; k < fraction.size(); k++)
+		ok &= (static_cast<unsigned>(static_cast<unsigned char>(fraction[k]) - '0') <= 9);
+	if (fraction.size() > scale)
+		f += (fraction[scale] >= '5');
+
+	const bool negative = !integer.empty() && integer[0] == '-';
+	int64_t scaled;
+	ok &= !__builtin_mul_overflow(i, static_cast<int64_t>(p), &scaled);
+	ok &= !__builtin_add_overflow(scaled, negative ? -static_cast<int64_t>(f) : static_cast<int64_t>(f), &val);
+	return ok;
+}
+
+
+// parse str in val with std::from_chars; false when str is not a number (or is nan). An empty str is 0
+inline bool fast_atod(const boost::string_view& str, double& val)
+{
+	val = 0;
+	const char* b = str.data();
+	const char* const e = b + str.size();
+	if (b == e)
+		return true;
+	if (*b == '+')
+		b++;
+
+	const auto r = std::from_chars(b, e, val);
+	return r.ec == std::errc() && r.ptr == e && !std::isnan(val);
+}
+
+
+// bytes of the first file sampled to choose how keys are stored, slots of the dense arrays
+constexpr size_t sample_bytes{1024 * 1024};
+constexpr size_t dense_max_slots{1024 * 1024};
+// past 2^12 partitions the scatter buffers no longer stay in cache and the partitions
+// are smaller than a cache anyway
+constexpr size_t max_radix_bits{12};
+
+
+// settings shared by all the aggregators
+struct aggr_options_t
+{
+	int64_t no_value{-1};
+	size_t groups_hint{0};
+	size_t memory_limit{0};    // for each aggregator, 0 is no limit
+	Spill* spill{nullptr};
+	size_t radix_bits{0};      // 0: rows go straight to the table
+	const DenseKeys* dense{nullptr};   // direct indexing of small integer keys (without radix partitions)
+	const KeyDictionary* keys{nullptr};   // dictionary encoding of the key columns (never with dense)
+	size_t batch_size{0};      // without radix partitions: rows buffered before probing the table, 0 is none
+};
+
+
+class Aggregator
+{
+public:
+	Aggregator(const std::map<uint32_t, uint32_t>& keys_fields, const aggregates_t& aggregates, const aggr_options_t& opts)
+		: _aggregates(aggregates)
+		, _opts(opts)
+		, _key_columns(get_columns(keys_fields))
+		, _key_builder(_key_columns)
+		, _encoder(opts.keys)
+		, _encoded(opts.keys != nullptr && opts.keys->enabled())
+		, _parsed(aggregates.inputs.size())
+		, _parsed_real(aggregates.inputs.size())
+		, _parsed_valid(aggregates.inputs.size())
+		, _values(aggregates.size())
+		, _valid((aggregates.size() + 63) / 64)
+	{
+		for (size_t k = aggregates_t::rows; k <= aggregates_t::max; k++)
+			_first[k - aggregates_t::rows] = aggregates.first(static_cast<aggregates_t::kind_t>(k));
+
+		// the integer columns keep their own loop, the others are parsed by type
+		for (const auto& index : aggregates.inputs)
 		{
-			i = 0;
+			const auto& type = aggregates.types[index.second];
+			if (type.kind == column_type_t::integer)
+				_int_inputs.push_back(index);
+			else
+			{
+				int64_t no_value{_opts.no_value};
+				for (size_t d = 0; d < type.scale; d++)
+					no_value *= 10;
+				_typed_inputs.push_back({index.first, index.second, type, no_value});
+			}
 		}
+
+		reset();
+		if (buffered())
+			_scatter.resize(parts.size());
 	}
 
-	for (; i < l; i++)
-		val = val*10 + (str[i] - '0');
+	void operator()(const row_t& v)
+	{
+		for (const auto& index : _int_inputs)
+		{
+			int64_t n{0};
+			const bool ok = fast_atol(v[index.first], n);
+			parsed_int(index.second, ok, n);
+		}
+		add(v);
+	}
 
-	if (negative)
-		return -val;
-	else
-		return val;
-}
+	// a row whose integer fields may come already parsed: ints[c] when parsed[c] (a cached file)
+	void operator()(const row_t& v, const int64_t* ints, const std::vector<bool>& parsed)
+	{
+		for (const auto& index : _int_inputs)
+		{
+			int64_t n = ints[index.first];
+			const bool ok = parsed[index.first] || fast_atol(v[index.first], n);
+			parsed_int(index.second, ok, n);
+		}
+		add(v);
+	}
+
+	// the integer inputs that are not key fields too: a cached file can give them already parsed
+	std::vector<bool> int_inputs(size_t fields) const
+	{
+		std::vector<bool> ints(fields, false);
+		for (const auto& index : _int_inputs)
+			ints[index.first] = std::find(_key_columns.begin(), _key_columns.end(), index.first) == _key_columns.end();
+		return ints;
+	}
+
+	// aggregate the rows still waiting in the partitions
+	void finish()
+	{
+		if (buffered())
+			drain();
+	}
+
+	// move all the groups to a spill run
+	void flush()
+	{
+		if (size() == 0)
+			return;
+
+		_opts.spill->write(parts);
+		reset();
+		_encoder.clear();
+	}
+
+	void merge(Aggregator& other)
+	{
+		for (size_t p = 0; p < parts.size(); p++)
+		{
+			auto& groups = parts[p];
+			auto& o = other.parts[p];
+
+			groups.table.reserve(groups.size() + o.size());
+			groups.arena.adopt(o.arena);
+
+			for (size_t g = 0; g < o.size(); g++)
+			{
+				o.sums.get(g, _values.data(), _valid.data());
+				groups.add(o.hashes[g], o.keys[g], _values.data(), _valid.data(), false);
+			}
+		}
+
+		other.reset();
+	}
+
+	size_t size() const
+	{
+		size_t n{0};
+		for (const auto& groups : parts)
+			n += groups.size();
+		return n;
+	}
+
+	// bytes of the groups, of the scatter buffers and of the dictionary caches, with the fixed
+	// cost of every partition
+	size_t memory() const
+	{
+		size_t n{parts.capacity() * sizeof(groups_t) + _scatter.capacity() * sizeof(scatter_t) + _encoder.memory()};
+		for (const auto& groups : parts)
+			n += groups.memory();
+		for (const auto& b : _scatter)
+			n += b.memory();
+		return n;
+	}
+
+	// the groups, split by the top radix_bits of their hash
+	std::vector<groups_t> parts;
+
+private:
+	void parsed_int(size_t input, bool ok, int64_t n)
+	{
+		const bool is_valid = ok && (n != _opts.no_value);
+		_parsed[input] = is_valid ? n : 0;
+		_parsed_valid[input] = is_valid;
+	}
+
+	// aggregate the row, its integer inputs being parsed
+	void add(const row_t& v)
+	{
+		for (const auto& t : _typed_inputs)
+			parse(v[t.column], t);
+		fill();
+
+		size_t s;
+		if (!_dense.empty() && _opts.dense->slot(v, _key_columns, s))
+		{
+			auto& groups = parts[0];
+			if (_dense[s] != dense_none)
+			{
+				groups.sums.add(_dense[s], _values.data(), _valid.data());
+				return;
+			}
+
+			// a key with a slot never went through the table, so here it's a new group
+			// (after a spill reset() clears the slots again)
+			_dense[s] = static_cast<uint32_t>(groups.size());
+			insert(groups, _key_builder.hash(v), v);
+			return;
+		}
+
+		if (_encoded)
+		{
+			uint64_t h;
+			const auto k = _encoder.encode(v, _key_columns, h);
+			if (!buffered())
+				insert(parts[0], h, k);
+			else
+				scatter(h, k);
+			return;
+		}
+
+		const uint64_t key = _key_builder.hash(v);
+
+		if (!buffered())
+			insert(parts[0], key, v);
+		else
+			scatter(key, v);
+	}
+
+	// rows of a partition waiting to be aggregated: hash, key (see intern_key), values and validity
+	struct scatter_t
+	{
+		std::vector<uint64_t> hashes;
+		std::vector<size_t> key_ends;
+		std::vector<char> keys;
+		std::vector<int64_t> values;
+		std::vector<uint64_t> valid;
+
+		size_t memory() const
+		{
+			return hashes.capacity() * sizeof(uint64_t) + key_ends.capacity() * sizeof(size_t) + keys.capacity()
+				+ values.capacity() * sizeof(int64_t) + valid.capacity() * sizeof(uint64_t);
+		}
+	};
+
+	struct typed_input_t
+	{
+		uint32_t column;
+		uint32_t input;
+		column_type_t type;
+		int64_t no_value;   // scaled for a fixed point column
+	};
+
+	// the slots of the row from the parsed values, a loop for every function
+	void fill()
+	{
+		std::fill(_valid.begin(), _valid.end(), 0);
+		const auto& slots = _aggregates.slots;
+
+		size_t j{0};
+		for (; j < _first[0]; j++)
+		{
+			const auto i = slots[j].input;
+			set(j, _parsed[i], _parsed_valid[i]);
+		}
+		for (; j < _first[1]; j++)
+			set(j, 1, true);
+		for (; j < _first[2]; j++)
+			set(j, _parsed_valid[slots[j].input], true);
+		for (; j < _first[3]; j += _aggregates.compensated ? 2 : 1)
+		{
+			const auto i = slots[j].input;
+			set(j, double_bits(_parsed_real[i]), _parsed_valid[i]);
+			if (_aggregates.compensated)
+				set(j + 1, 0, _parsed_valid[i]);
+		}
+		for (; j < _first[4]; j++)
+		{
+			const auto i = slots[j].input;
+			set(j, _parsed_valid[i] ? _parsed[i] : std::numeric_limits<int64_t>::max(), _parsed_valid[i]);
+		}
+		for (; j < slots.size(); j++)
+		{
+			const auto i = slots[j].input;
+			set(j, _parsed_valid[i] ? _parsed[i] : std::numeric_limits<int64_t>::min(), _parsed_valid[i]);
+		}
+	}
+
+	// a fixed point or double column: in _parsed the scaled integer or the order_bits of the double
+	void parse(const boost::string_view& str, const typed_input_t& t)
+	{
+		bool is_valid;
+		if (t.type.kind == column_type_t::fixed)
+		{
+			int64_t n;
+			is_valid = fast_atofixed(str, t.type.scale, n) && (n != t.no_value);
+			_parsed[t.input] = is_valid ? n : 0;
+		}
+		else
+		{
+			double d;
+			is_valid = fast_atod(str, d) && (d != static_cast<double>(_opts.no_value));
+			_parsed_real[t.input] = is_valid ? d : 0.0;
+			_parsed[t.input] = is_valid ? order_bits(d) : 0;
+		}
+		_parsed_valid[t.input] = is_valid;
+	}
+
+	void set(size_t j, int64_t value, bool valid)
+	{
+		_values[j] = value;
+		_valid[j / 64] |= static_cast<uint64_t>(valid) << (j % 64);
+	}
+
+	// rows go through the scatter buffers: for the radix partitions or in batches
+	bool buffered() const { return _opts.radix_bits != 0 || _opts.batch_size != 0; }
+
+	scatter_t& buffer_of(uint64_t key) { return _scatter[_opts.radix_bits == 0 ? 0 : key >> (64 - _opts.radix_bits)]; }
+
+	void reset()
+	{
+		const size_t n = size_t{1} << _opts.radix_bits;
+		parts.clear();
+		for (size_t p = 0; p < n; p++)
+		{
+			parts.emplace_back(_aggregates.layout());
+			parts.back().reserve(_opts.groups_hint / n);
+		}
+
+		if (_opts.dense != nullptr && _opts.dense->enabled() && _opts.radix_bits == 0)
+			_dense.assign(_opts.dense->slots(), dense_none);
+	}
+
+	void insert(groups_t& groups, uint64_t key, const row_t& v)
+	{
+		const auto r = groups.table.insert(key, [this, &groups, &v](uint32_t g) {
+			return key_equal(groups.keys[g], v, _key_columns);
+		});
+		if (!r.second)
+		{
+			//exists
+			groups.sums.add(r.first, _values.data(), _valid.data());
+		}
+		else
+		{
+			groups.hashes.push_back(key);
+			groups.keys.push_back(intern_key(groups.arena, v, _key_columns));
+			groups.sums.push(_values.data(), _valid.data());
+
+			if (_opts.memory_limit != 0 && groups.memory() > _opts.memory_limit)
+				flush();
+		}
+	}
+
+	// an already built key
+	void insert(groups_t& groups, uint64_t key, const boost::string_view& k)
+	{
+		const size_t n = groups.size();
+		groups.add(key, k, _values.data(), _valid.data(), true);
+
+		if (groups.size() != n && _opts.memory_limit != 0 && groups.memory() > _opts.memory_limit)
+			flush();
+	}
+
+	// first phase: the row goes in the buffer of its partition
+	void scatter(uint64_t key, const row_t& v)
+	{
+		auto& b = buffer_of(key);
+		const size_t n = key_size(v, _key_columns);
+
+		b.keys.resize(b.keys.size() + n);
+		encode_key(b.keys.data() + b.keys.size() - n, v, _key_columns);
+		scattered(b, key, n);
+	}
+
+	void scatter(uint64_t key, const boost::string_view& k)
+	{
+		auto& b = buffer_of(key);
+
+		b.keys.insert(b.keys.end(), k.begin(), k.end());
+		scattered(b, key, k.size());
+	}
+
+	// the rest of a row whose key (n bytes) is already in the buffer
+	void scattered(scatter_t& b, uint64_t key, size_t n)
+	{
+		b.hashes.push_back(key);
+		b.key_ends.push_back(b.keys.size());
+		b.values.insert(b.values.end(), _values.begin(), _values.end());
+		b.valid.insert(b.valid.end(), _valid.begin(), _valid.end());
+
+		_scattered += sizeof(uint64_t) + sizeof(size_t) + n + _values.size() * sizeof(int64_t) + _valid.size() * sizeof(uint64_t);
+		if (_scattered > _scatter_bytes || (_opts.radix_bits == 0 && b.hashes.size() >= _opts.batch_size))
+			drain();
+	}
+
+	// second phase: every partition is aggregated alone, so its table stays in cache.
+	// The slots of the rows prefetch_distance ahead are prefetched, so that their misses overlap
+	void drain()
+	{
+		const size_t w = _values.size();
+		const size_t mw = _valid.size();
+
+		for (size_t p = 0; p < parts.size(); p++)
+		{
+			auto& b = _scatter[p];
+			auto& groups = parts[p];
+			const size_t n = b.hashes.size();
+
+			for (size_t i = 0; i < std::min(n, prefetch_distance); i++)
+				groups.table.prefetch(b.hashes[i]);
+
+			size_t key_begin{0};
+			for (size_t i = 0; i < n; i++)
+			{
+				if (i + prefetch_distance < n)
+					groups.table.prefetch(b.hashes[i + prefetch_distance]);
+
+				const boost::string_view key(b.keys.data() + key_begin, b.key_ends[i] - key_begin);
+				groups.add(b.hashes[i], key, &b.values[i * w], &b.valid[i * mw], true);
+				key_begin = b.key_ends[i];
+			}
+
+			b.hashes.clear();
+			b.key_ends.clear();
+			b.keys.clear();
+			b.values.clear();
+			b.valid.clear();
+		}
+
+		_scattered = 0;
+		if (_opts.memory_limit != 0 && memory() > _opts.memory_limit)
+			flush();
+	}
+
+	constexpr static size_t scatter_bytes{16 * 1024 * 1024};
+	constexpr static size_t prefetch_distance{16};
+
+	const aggregates_t& _aggregates;
+	std::array<size_t, 5> _first;   // first slot of rows, count, real_sum, min and max
+
+	std::vector<std::pair<uint32_t, uint32_t>> _int_inputs;   // column, input
+	std::vector<typed_input_t> _typed_inputs;
+
+	const aggr_options_t& _opts;
+	std::vector<uint32_t> _key_columns;   // in the order of the -k list
+	std::vector<uint32_t> _dense;         // group of every dense slot
+	constexpr static uint32_t dense_none{std::numeric_limits<uint32_t>::max()};
+	BuildKey _key_builder;
+	KeyEncoder _encoder;
+	bool _encoded;
+
+	// parsed columns of the current row (0 when not valid)
+	std::vector<int64_t> _parsed;
+	std::vector<double> _parsed_real;   // of the double columns
+	std::vector<uint8_t> _parsed_valid;
+
+	// slots of the current row (the neutral value when not valid) and their validity bitmap
+	std::vector<int64_t> _values;
+	std::vector<uint64_t> _valid;
+
+	std::vector<scatter_t> _scatter;
+	size_t _scattered{0};
+	// rows buffered before a drain: with a memory limit, a quarter of it at most
+	const size_t _scatter_bytes{_opts.memory_limit == 0 ? scatter_bytes : std::min(scatter_bytes, _opts.memory_limit / 4)};
+};
+
+
+// write a group as a csv row: the projection list is compiled once in a flat plan
+class RowFormatter
+{
+public:
+	RowFormatter(
+		const std::vector<std::string>& proj_fields,
+		const std::map<std::string, std::string>& registers,
+		const std::map<uint32_t, uint32_t>& keys_fields,
+		const aggregates_t& aggregates,
+		const KeyDictionary& keys,
+		int64_t no_value,
+		const std::string& output_sep)
+		: _keys(keys)
+		, _no_value(no_value)
+		, _compensated(aggregates.compensated)
+	{
+		// registers and separators are merged in constant text, emitted with a single copy
+		std::string pending;
+		auto emit_text = [this, &pending]() {
+			if (pending.empty())
+				return;
+			_plan.push_back({op_t::text, static_cast<uint32_t>(_text.size()), static_cast<uint32_t>(pending.size())});
+			_text += pending;
+			pending.clear();
+		};
+
+		for (size_t j = 0; j < proj_fields.size(); j++)
+		{
+			if (j != 0)
+				pending += output_sep;
+
+			const auto& e = proj_fields[j];
+			if (e[0] == '%')
+			{
+				const auto rt = registers.find(e);
+				if (rt != registers.end())
+					pending += rt->second;
+				continue;
+			}
+
+			// fn:column or count is an aggregate, a plain column its sum or else a key field
+			const auto p = e.find(':');
+			const std::string name = (p == std::string::npos) ? e : e.substr(0, p);
+
+			uint32_t k{0};
+			try {
+				k = std::stoul((p == std::string::npos) ? e : e.substr(p + 1));
+			} catch (...) {}
+
+			aggregates_t::kind_t kind{aggregates_t::sum};
+			if (p != std::string::npos && name == "avg")
+			{
+				const auto sum = aggregates.find(aggregates_t::sum, k);
+				const auto count = aggregates.find(aggregates_t::count, k);
+				if (sum == aggregates_t::npos || count == aggregates_t::npos)
+					missing(e);
+
+				emit_text();
+				const auto type = aggregates.type_of(k);
+				_plan.push_back({type.kind == column_type_t::real ? op_t::avg_real : op_t::avg, sum, count, type.scale});
+				continue;
+			}
+			const bool function = (p != std::string::npos || e == "count");
+			if (function && !aggregates_t::kind_of(name, p != std::string::npos, kind))
+			{
+				std::cerr << "Unknown aggregate function: " << name << std::endl;
+				exit(1);
+			}
+
+			const auto it = aggregates.find(kind, k);
+			const auto jt = keys_fields.find(k);
+			if (function && it == aggregates_t::npos)
+				missing(e);
+			if (it != aggregates_t::npos)
+			{
+				emit_text();
+				_plan.push_back(value_op(aggregates, it));
+			}
+			else if (p == std::string::npos && e != "count" && jt != keys_fields.end())
+			{
+				emit_text();
+				_plan.push_back({op_t::key, jt->second, 0});
+				_use_keys = true;
+			}
+		}
+
+		pending += end_line;
+		emit_text();
+	}
+
+	size_t length(const groups_t& groups, size_t g)
+	{
+		size_t n{0};
+		cells(groups, g,
+			[&n](const boost::string_view& s) { n += s.size(); },
+			[&n](auto v) { n += chars_length(v); });
+		return n;
+	}
+
+	void format(OutBuffer& out, const groups_t& groups, size_t g)
+	{
+		cells(groups, g,
+			[&out](const boost::string_view& s) { out.append(s); },
+			[&out](auto v) { out.append(v); });
+	}
+
+private:
+	struct op_t
+	{
+		enum kind_t : uint8_t { text, key, value, fixed, real, real_sum, avg, avg_real };
+
+		kind_t kind;
+		uint32_t index;    // offset inside _text, key slot or aggregate slot (the sum for avg)
+		uint32_t length;   // text: its length, avg: the slot of the count
+		uint8_t scale{0};  // decimals of a fixed point value
+	};
+
+	// an aggregate of the projection list that the -s list does not compute
+	[[noreturn]] static void missing(const std::string& e)
+	{
+		std::cerr << "Projection field " << e << " is not computed by the aggregation fields list" << std::endl;
+		exit(1);
+	}
+
+	// how the aggregate slot j is written
+	static op_t value_op(const aggregates_t& aggregates, uint32_t j)
+	{
+		const auto& slot = aggregates.slots[j];
+		if (slot.kind == aggregates_t::rows || slot.kind == aggregates_t::count)
+			return {op_t::value, j, 0};
+		if (slot.kind == aggregates_t::real_sum)
+			return {op_t::real_sum, j, 0};
+
+		const auto type = aggregates.type_of(slot.column);
+		switch (type.kind)
+		{
+			case column_type_t::fixed:
+				return {op_t::fixed, j, 0, type.scale};
+			case column_type_t::real:
+				return {op_t::real, j, 0};
+			case column_type_t::integer:
+				break;
+		}
+		return {op_t::value, j, 0};
+	}
+
+	// the double sum of the slot j, with its compensation
+	double real_sum(const groups_t& groups, size_t g, size_t j) const
+	{
+		const double s = bits_double(groups.sums.value(g, j));
+		return _compensated ? s + bits_double(groups.sums.value(g, j + 1)) : s;
+	}
+
+	// run the plan on the group g
+	template <typename S, typename N>
+	void cells(const groups_t& groups, size_t g, S put_str, N put_num)
+	{
+		if (_use_keys)
+			_keys.fields(groups.keys[g], _key_val);
+
+		for (const auto& op : _plan)
+		{
+			switch (op.kind)
+			{
+				case op_t::text:
+					put_str(boost::string_view(_text.data() + op.index, op.length));
+					break;
+				case op_t::key:
+					put_str(_key_val[op.index]);
+					break;
+				case op_t::value:
+					put_num(groups.sums.valid(g, op.index) ? groups.sums.value(g, op.index) : _no_value);
+					break;
+				case op_t::fixed:
+					if (groups.sums.valid(g, op.index))
+						put_str(boost::string_view(_scratch, format_fixed(_scratch, groups.sums.value(g, op.index), op.scale)));
+					else
+						put_num(_no_value);
+					break;
+				case op_t::real:
+					if (groups.sums.valid(g, op.index))
+						put_num(order_double(groups.sums.value(g, op.index)));
+					else
+						put_num(_no_value);
+					break;
+				case op_t::real_sum:
+					if (groups.sums.valid(g, op.index))
+						put_num(real_sum(groups, g, op.index));
+					else
+						put_num(_no_value);
+					break;
+				case op_t::avg:
+				case op_t::avg_real:
+				{
+					const int64_t n = groups.sums.value(g, op.length);
+					if (n == 0)
+						put_num(_no_value);
+					else if (op.kind == op_t::avg_real)
+						put_num(real_sum(groups, g, op.index) / n);
+					else
+						put_num(static_cast<double>(groups.sums.value(g, op.index)) / power10(op.scale) / n);
+					break;
+				}
+			}
+		}
+	}
+
+	const KeyDictionary& _keys;
+	const int64_t _no_value;
+	const bool _compensated;
+	std::vector<op_t> _plan;
+	std::string _text;
+	bool _use_keys{false};
+
+	std::vector<boost::string_view> _key_val;
+	char _scratch[max_fixed_chars];
+	constexpr static char end_line{'\n'};
+};
 
 
 void help();
 void dry_run(
 	const vector<string>& fnames,
 	std::map<uint32_t, uint32_t>& keys_fields,
-	std::map<uint32_t, uint32_t>& sum_fields,
+	const aggregates_t& aggregates,
 	std::vector<std::string>& proj_fields,
 	const map<string, string>& registers,
 	const string& output_header,
@@ -282,7 +1370,9 @@ void dry_run(
 
 int main(int argc, char* argv[])
 {
-	std::map<uint32_t, uint32_t> sum_fields;
+	std::string sum_list;
+	std::map<uint32_t, column_type_t> column_types;
+	bool compensated{false};
 	std::map<uint32_t, uint32_t> keys_fields;
 	std::vector<std::string> proj_fields;
 
@@ -297,6 +1387,23 @@ int main(int argc, char* argv[])
 	int64_t no_value{-1};
 	std::string input_sep{","}, output_sep{","};
 	std::string output_file{"out.csv"};
+	size_t threads{1};
+	size_t chunk_size{16 * 1024 * 1024};
+	size_t groups_hint{0};
+	size_t memory_limit{0};
+	size_t radix_bits{0};
+	std::string dense_keys{"auto"};
+	size_t batch_size{256};
+	std::string dict_keys{"auto"};
+	size_t output_threads{1};
+	size_t decompress_threads{0};
+	std::string io{"auto"};
+	size_t io_depth{4};
+	size_t window{64};
+	bool drop_cache{false};
+	size_t prefetch{1};
+	std::string cache_dir;
+	std::string spill_dir{temp_directory_path().native()};
 
 	if (argc == 1)
 	{
@@ -320,7 +1427,7 @@ int main(int argc, char* argv[])
 		else if (strcmp(argv[i], "-k") == 0)
 			keys_fields = get_index_uint32(argv[++i]);
 		else if (strcmp(argv[i], "-s") == 0)
-			sum_fields = get_index_uint32(argv[++i]);
+			sum_list = argv[++i];
 		else if (strcmp(argv[i], "-p") == 0)
 			proj_fields = get_index_string(argv[++i]);
 		else if (strcmp(argv[i], "--skip-line") == 0)
@@ -335,7 +1442,11 @@ int main(int argc, char* argv[])
 		{
 			const string f_path = argv[++i];
 			for_each(directory_iterator(f_path), directory_iterator(), [&fnames](directory_entry& p){
-				if (is_regular_file(p) && p.path().extension() == ".csv")
+				// plain or compressed csv files
+				auto path = p.path();
+				if (path.extension() == ".gz" || path.extension() == ".zst")
+					path = path.stem();
+				if (is_regular_file(p) && path.extension() == ".csv")
 				{
 					fnames.push_back(p.path().native());
 				}
@@ -349,6 +1460,56 @@ int main(int argc, char* argv[])
 			output_sep = argv[++i];
 		else if (strcmp(argv[i], "--output-file") == 0)
 			output_file = argv[++i];
+		else if (strcmp(argv[i], "--threads") == 0)
+			threads = std::stoul(argv[++i]);
+		else if (strcmp(argv[i], "--chunk-size") == 0)
+			chunk_size = std::stoull(argv[++i]);
+		else if (strcmp(argv[i], "--groups-hint") == 0)
+			groups_hint = std::stoull(argv[++i]);
+		else if (strcmp(argv[i], "--memory-limit") == 0)
+			memory_limit = std::stoull(argv[++i]) * 1024 * 1024;
+		else if (strcmp(argv[i], "--spill-dir") == 0)
+			spill_dir = argv[++i];
+		else if (strcmp(argv[i], "--output-threads") == 0)
+			output_threads = std::stoul(argv[++i]);
+		else if (strcmp(argv[i], "--decompress-threads") == 0)
+			decompress_threads = std::stoul(argv[++i]);
+		else if (strcmp(argv[i], "--io") == 0)
+			io = argv[++i];
+		else if (strcmp(argv[i], "--io-depth") == 0)
+			io_depth = std::stoull(argv[++i]);
+		else if (strcmp(argv[i], "--window") == 0)
+			window = std::stoull(argv[++i]);
+		else if (strcmp(argv[i], "--drop-cache") == 0)
+			drop_cache = true;
+		else if (strcmp(argv[i], "--prefetch") == 0)
+			prefetch = std::stoull(argv[++i]);
+		else if (strcmp(argv[i], "--cache") == 0)
+			cache_dir = argv[++i];
+		else if (strcmp(argv[i], "--radix-bits") == 0)
+			radix_bits = std::min(max_radix_bits, std::stoul(argv[++i]));
+		else if (strcmp(argv[i], "--decimal") == 0)
+		{
+			// columns:scale
+			const string args = argv[++i];
+			const auto p = args.find(":");
+			const auto scale = static_cast<uint8_t>(std::min(18ul, p == string::npos ? 0ul : std::stoul(args.substr(p + 1))));
+			for (const auto& c : get_index_uint32(args.substr(0, p)))
+				column_types[c.first] = {column_type_t::fixed, scale};
+		}
+		else if (strcmp(argv[i], "--double") == 0)
+		{
+			for (const auto& c : get_index_uint32(argv[++i]))
+				column_types[c.first] = {column_type_t::real, 0};
+		}
+		else if (strcmp(argv[i], "--kahan") == 0)
+			compensated = true;
+		else if (strcmp(argv[i], "--batch-size") == 0)
+			batch_size = std::stoull(argv[++i]);
+		else if (strcmp(argv[i], "--dense-keys") == 0)
+			dense_keys = argv[++i];
+		else if (strcmp(argv[i], "--dict-keys") == 0)
+			dict_keys = argv[++i];
 		else if (strcmp(argv[i], "-r") == 0)
 		{
 			string args = argv[++i];
@@ -363,139 +1524,256 @@ int main(int argc, char* argv[])
 
 
 	if (proj_fields.empty()) { std::cerr << "Projection fields list is empty!" << std::endl; exit(1); }
-	if (sum_fields.empty())  { std::cerr << "Aggregation fields list is empty!" << std::endl; exit(1); }
+	if (sum_list.empty())    { std::cerr << "Aggregation fields list is empty!" << std::endl; exit(1); }
 	if (keys_fields.empty()) { std::cerr << "Key fields list is empty!" << std::endl; exit(1); }
 	if (fnames.empty())      { std::cerr << "No files selected" << std::endl; exit(1); }
 
+	const aggregates_t aggregates = get_aggregates(sum_list, column_types, compensated);
+
 
 	if (dry_run_exec)
 	{
-		dry_run(fnames, keys_fields, sum_fields, proj_fields, registers, output_header, input_sep);
+		dry_run(fnames, keys_fields, aggregates, proj_fields, registers, output_header, input_sep);
 		return 0;
 	}
 
-	const auto non_valid = std::make_pair(0, false);
-	
-	BuildKey key_builder{keys_fields};
-	std::unordered_map<uint64_t, mapval_t<int64_t>> map_object;
-
-	//( value , is_valid )
-	std::vector<std::pair<int64_t, bool>> partial(sum_fields.size());
-	const size_t ksize = keys_fields.size();
-
-	for (const auto& fname : fnames)
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	if (decompress_threads == 0)
+		decompress_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	input_options_t input;
+	input.io = io_backend_of(io);
+	input.io_depth = io_depth;
+	input.decompress_threads = decompress_threads;
+	input.window = window * 1024 * 1024;
+	input.drop_cache = drop_cache;
+
+	// the tokenizer can stop at the last key or sum field of every line
+	size_t needed_fields = keys_fields.rbegin()->first + size_t{1};
+	if (!aggregates.inputs.empty())
+		needed_fields = std::max<size_t>(needed_fields, aggregates.inputs.rbegin()->first + size_t{1});
+
+	// with --cache the files are read back from the columnar caches written by a previous run,
+	// the others write theirs; only the files read in text are read ahead, a cache maps just
+	// the columns used
+	std::vector<std::unique_ptr<ColumnCache>> caches(fnames.size());
+	std::vector<std::unique_ptr<ColumnCache::Writer>> writers(fnames.size());
+	std::vector<std::string> prefetched{fnames};
+	if (!cache_dir.empty())
 	{
-		splitter(fname, input_sep, [&map_object, &partial, &sum_fields, &ksize, &keys_fields, &no_value, &non_valid, &key_builder](const std::vector<boost::string_view>& v)
+		create_directories(cache_dir);
+		for (size_t f = 0; f < fnames.size(); f++)
 		{
-			for (const auto& index : sum_fields)
-			{
-				int64_t n = fast_atol(v[index.first]);
-				//std::cerr << "f: " << index.first << ", s: " << index.second << ", n: " << n << std::endl;
-				if(n != no_value)
-					partial[index.second] = make_pair(n, true);
-				else
-					partial[index.second] = non_valid;
-			}
-			
-			const uint64_t key = key_builder.hash(v);
-			
-			auto it = map_object.find(key);
-			if (it != map_object.end())
-			{
-				//exists
-				std::transform(
-					it->second.sum_val.begin(), it->second.sum_val.end(),
-					partial.begin(), it->second.sum_val.begin(),
-					[](const pval_t& a, const pval_t& b)
-					{
-						if (a.second == true && b.second == true)
-							return std::make_pair(a.first + b.first, true);
-						else if (a.second == true && b.second == false)
-							return std::make_pair(a.first, true);
-						else if (a.second == false && b.second == true)
-							return std::make_pair(b.first, true);
-						else
-							return std::make_pair(static_cast<int64_t>(0), false);
-					}
-				);
-			}
+			caches[f] = ColumnCache::open(cache_dir, fnames[f], input_sep[0], skip_line);
+			if (caches[f])
+				prefetched[f].clear();
 			else
-			{
-				auto& obj = map_object[key];
-				obj.key_val.resize(ksize);
-				for (const auto& index : keys_fields)
-					obj.key_val[index.second] = v.at(index.first).to_string();
-
-				obj.sum_val = partial;
-			}
-		}, skip_line);
+				writers[f] = std::make_unique<ColumnCache::Writer>(cache_dir, fnames[f], input_sep[0], skip_line);
+		}
 	}
 
-	// save
-	std::ofstream fout{output_file};
+	// big files are cut in ranges so that all the threads can work on them
+	const auto chunks = get_chunks(fnames, caches, threads, chunk_size);
+	threads = std::min(threads, chunks.size());
+
+	// the groups of a cache being written take about group_bytes in every thread: a share of
+	// the memory limit, when there is one
+	size_t cache_group_bytes{16 * 1024 * 1024};
+	if (memory_limit != 0)
+		cache_group_bytes = std::max<size_t>(1024 * 1024, std::min(cache_group_bytes, memory_limit / threads / 4));
+
+	// past the memory limit the groups are spilled to disk (the limit is shared between the threads)
+	std::unique_ptr<Spill> spill;
+	if (memory_limit != 0)
+		spill = std::make_unique<Spill>(spill_dir);
+
+	aggr_options_t opts;
+	opts.no_value = no_value;
+	opts.groups_hint = groups_hint;
+	opts.memory_limit = memory_limit / threads;
+	opts.spill = spill.get();
+	opts.radix_bits = radix_bits;
+	opts.batch_size = batch_size;
+
+	// keys of small integers are aggregated in a dense array: the ranges of the key columns
+	// come from a sample of the first file, or are [0, N) with --dense-keys N
+	const auto key_columns = get_columns(keys_fields);
+	DenseKeys dense;
+	if (radix_bits == 0 && dense_keys == "auto")
+	{
+		DenseKeys::Sampler sampler{key_columns};
+		splitter(fnames[0], input_sep, std::ref(sampler), skip_line, needed_fields, 0, sample_bytes, input);
+		dense = sampler.result(dense_max_slots);
+	}
+	else if (radix_bits == 0 && dense_keys != "off")
+	{
+		dense = DenseKeys::uniform(key_columns.size(), 0, std::stoull(dense_keys), dense_max_slots);
+		if (!dense.enabled()) { std::cerr << "Too many dense key slots, the limit is " << dense_max_slots << std::endl; exit(1); }
+	}
+	opts.dense = &dense;
+
+	// repetitive string keys are dictionary encoded: the columns are chosen on a sample of the
+	// first file, or are all of them with --dict-keys all. The dictionaries are shared by the
+	// threads and never spilled: with a memory limit they take a quarter of it at most
+	const size_t dict_budget = memory_limit / 4;
+	KeyDictionary key_dict;
+	if (!dense.enabled() && dict_keys == "auto")
+	{
+		KeyDictionary::Sampler sampler{key_columns};
+		splitter(fnames[0], input_sep, std::ref(sampler), skip_line, needed_fields, 0, sample_bytes, input);
+		key_dict = KeyDictionary{sampler.result(), dict_budget};
+	}
+	else if (!dense.enabled() && dict_keys == "all")
+		key_dict = KeyDictionary{std::vector<bool>(key_columns.size(), true), dict_budget};
+	opts.keys = &key_dict;
+	if (key_dict.enabled())
+		opts.memory_limit = (memory_limit - dict_budget) / threads;
+
+	// compiled before reading, so that a bad projection list fails at once
+	const RowFormatter formatter{proj_fields, registers, keys_fields, aggregates, key_dict, no_value, output_sep};
+
+	std::vector<Aggregator> aggregators;
+	aggregators.reserve(threads);
+	for (size_t t = 0; t < threads; t++)
+		aggregators.emplace_back(keys_fields, aggregates, opts);
+	if (opts.memory_limit != 0 && aggregators[0].memory() > opts.memory_limit / 2)
+	{
+		std::cerr << "The " << aggregators[0].parts.size() << " radix partitions of every thread need " << aggregators[0].memory() / 1024
+			<< " KiB, too much for --memory-limit: use less --radix-bits" << std::endl;
+		exit(1);
+	}
 
-	if (!output_header.empty())
-		fout << output_header << endl;
+	// the next files are read ahead while the current ones are aggregated
+	Prefetcher prefetcher{prefetched, prefetch};
 
+	// from a cache the integer sums come already parsed, the other fields used in text
+	const auto int_fields = aggregators[0].int_inputs(needed_fields);
+	std::vector<bool> text_fields(needed_fields, false);
+	for (const auto& k : keys_fields)
+		text_fields[k.first] = true;
+	for (const auto& index : aggregates.inputs)
+		text_fields[index.first] = text_fields[index.first] || !int_fields[index.first];
 
-	auto get = [&sum_fields, &keys_fields, &no_value](uint32_t k, const mapval_t<int64_t>& mval, auto printer) {
-		const auto it = sum_fields.find(k);
-		if (it != sum_fields.end())
-		{
-			// is a sum fields
-			const auto& val = mval.sum_val.at(it->second);
-			if (val.second)
-				printer(val.first);
-			else
-				printer(no_value);
-		}
+	// a chunk comes from the cache of its file, or from the file, writing its cache with --cache
+	auto read_chunk = [&](const chunk_t& c, Aggregator& aggregator)
+	{
+		prefetcher.reading(c.file);
+		if (caches[c.file])
+			caches[c.file]->replay(c.begin, c.end, text_fields, int_fields, aggregator);
+		else if (cache_dir.empty())
+			splitter(fnames[c.file], input_sep, std::ref(aggregator), skip_line, needed_fields, c.begin, c.end, input);
 		else
 		{
-			const auto jt = keys_fields.find(k);
-			printer(mval.key_val.at(jt->second));
+			ColumnCache::Builder builder{*writers[c.file], c.begin, cache_group_bytes};
+			splitter(fnames[c.file], input_sep, [&builder, &aggregator](const row_t& row) {
+				builder(row);
+				aggregator(row);
+			}, skip_line, 0, c.begin, c.end, input);
+			builder.finish();
 		}
 	};
 
+	if (threads == 1)
+	{
+		for (const auto& c : chunks)
+			read_chunk(c, aggregators[0]);
+		aggregators[0].finish();
+	}
+	else
+	{
+		// each worker picks the next chunk to load and aggregates it in its own table
+		std::atomic<size_t> next_chunk{0};
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++)
+		{
+			workers.emplace_back([&aggregators, &chunks, &next_chunk, &read_chunk, t]()
+			{
+				for (size_t n = next_chunk++; n < chunks.size(); n = next_chunk++)
+					read_chunk(chunks[n], aggregators[t]);
+				aggregators[t].finish();
+			});
+		}
 
-	auto print = [&output_sep, &fout](const auto& val_print, bool& flag) {
-		if (flag) { fout << val_print; flag = false; }
-		else
-			fout << output_sep << val_print;
-	};
+		for (auto& w : workers)
+			w.join();
+	}
 
+	// all the ranges of the files without a cache are done
+	for (auto& w : writers)
+		if (w)
+			w->finish();
 
-	std::vector<uint32_t> proj_fields_n;
-	std::transform(
-		proj_fields.begin(),
-		proj_fields.end(),
-		std::back_inserter(proj_fields_n),
-		[](const std::string& e) -> unsigned long {
-			try {
-				return std::stoul(e);
-			} catch (...) {
-				return 0;
-			}
-		}
-	);
+	const bool spilled = spill && spill->runs() > 0;
+	if (spilled)
+	{
+		// everything goes on disk, every partition will be aggregated alone
+		for (auto& a : aggregators)
+			a.flush();
+	}
+	else if (threads > 1)
+	{
+		// merge the partial tables into the biggest one
+		auto biggest = std::max_element(aggregators.begin(), aggregators.end(), [](const Aggregator& a, const Aggregator& b) {
+			return a.size() < b.size();
+		});
+		std::swap(aggregators[0].parts, biggest->parts);
+
+		for (size_t t = 1; t < threads; t++)
+			aggregators[0].merge(aggregators[t]);
+	}
+
+	// save
+	const int fd = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		std::cerr << "Cannot open the output file " << output_file << std::endl;
+		exit(1);
+	}
+
+	// parallel formatting needs to write at offsets: only for regular files
+	struct stat sb;
+	if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode))
+		output_threads = 1;
+	if (output_threads == 0)
+		output_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	size_t offset{0};
+	if (!output_header.empty())
+	{
+		OutBuffer out{fd};
+		out.append(output_header);
+		out.append('\n');
+		offset = output_header.size() + 1;
+	}
 
 	//show aggregate
-	for (const auto& o : map_object)
+	auto write_groups = [&](const std::vector<const groups_t*>& tables) {
+		size_t n{0};
+		for (const auto t : tables)
+			n += t->size();
+		const auto slices = get_slices(tables, n / (output_threads * 8) + 1);
+		offset = write_rows(fd, offset, slices, formatter, output_threads);
+	};
+
+	if (spilled)
 	{
-		size_t j{};
-		bool f{true};
-		for (const auto& e : proj_fields)
+		for (size_t p = 0; p < spill->partitions(); p++)
 		{
-			if (e[0] == '%')
-				print(registers[e], f);
-			else
-				get(proj_fields_n[j], o.second, [&print, &f](const auto& v){ print(v, f); });
-			j++;
+			groups_t partition{aggregates.layout()};
+			spill->read(p, partition);
+			write_groups({&partition});
 		}
-
-		fout << '\n';
+	}
+	else
+	{
+		std::vector<const groups_t*> tables;
+		for (const auto& groups : aggregators[0].parts)
+			tables.push_back(&groups);
+		write_groups(tables);
 	}
 
-	fout.close();
+	close(fd);
 }
 
 
@@ -507,12 +1785,14 @@ int main(int argc, char* argv[])
 void dry_run (
 	const std::vector<std::string>& fnames,
 	std::map<uint32_t, uint32_t>& keys_fields,
-	std::map<uint32_t, uint32_t>& sum_fields,
+	const aggregates_t& aggregates,
 	vector<string>& proj_fields,
 	const map<string,string>& registers,
 	const string& output_header,
 	const string& input_sep)
 {
+	const auto& sum_fields = aggregates.inputs;
+
 	// show files
 	for (const auto& f : fnames)
 		std::cout << "Reading file: " << f << endl;
@@ -523,9 +1803,19 @@ void dry_run (
 		std::string line;
 		std::vector<std::string> strs;
 
-		std::ifstream f{fnames[0]};
 		const auto sep = boost::is_any_of(input_sep);
-		std::getline(f, line);
+		if (compression_of(fnames[0]) != compression_t::none)
+		{
+			CompressedReader f{fnames[0], 1};
+			boost::string_view block;
+			if (f.next(block))
+				line = block.substr(0, block.find('\n')).to_string();
+		}
+		else
+		{
+			std::ifstream f{fnames[0]};
+			std::getline(f, line);
+		}
 		boost::split(strs, line, sep);
 
 		if (strs.size() == 1)
@@ -537,7 +1827,7 @@ void dry_run (
 		//string key = build_key(keys_fields, strs);
 		std::cout << "#fields:\t" << strs.size() << endl;
 		std::cout << "keys size:\t" << keys_fields.size() << endl;
-		std::cout << "aggr size:\t" << sum_fields.size() << endl;
+		std::cout << "aggr size:\t" << aggregates.functions() << endl;
 		std::cout << "prj size:\t" << proj_fields.size() << endl;
 		//std::cout << "Key:\t" << key << endl;
 		std::cout << "Output Header:\t" << output_header << endl;
@@ -599,9 +1889,10 @@ void dry_run (
 			const auto bad_keys = std::count_if(keys_fields.begin(), keys_fields.end(), [&strs](const auto& e){ return e.first >= strs.size(); });
 			const auto bad_sum = std::count_if(sum_fields.begin(), sum_fields.end(), [&strs](const auto& e){ return e.first >= strs.size(); });
 			const auto bad_prj = std::count_if(proj_fields.begin(), proj_fields.end(), [&strs](const string& e){
-				if (e.find("%") == string::npos)
-					return stoull(e) >= strs.size();
-				return false;
+				if (e.find("%") != string::npos || e == "count")
+					return false;
+				const auto p = e.find(":");
+				return stoull(p == string::npos ? e : e.substr(p + 1)) >= strs.size();
 			});
 
 			if (bad_keys > 0)
@@ -622,15 +1913,35 @@ void help()
 	cout << "Aggregation Tool " << VERSION << " compiled on " << __DATE__ << "@" << __TIME__ << endl << endl;
 	cout << "aggregate [options]" << endl << endl;
 	cout << " -k               are the keys-elements used for aggregation" << endl;
-	cout << " -s               are the sums-elements used for aggregation" << endl;
-	cout << " -p               are the sums-elements used for projection" << endl;
+	cout << " -s               are the sums-elements used for aggregation; fn:elements computes fn in sum, count, min, max or avg of the elements, count alone the number of rows" << endl;
+	cout << " -p               are the sums-elements used for projection; fn:element or count is an aggregate of -s" << endl;
 	cout << " -r               specify a register ex.: -r %t:123; you can use that register inside a projection list" << endl;
 	cout << " --skip-line      number of rows (starting from head) to skip" << endl;
-	cout << " -f               is the file to load (coudl be used serveral times)" << endl;
-	cout << " --path           is the path where to find csv input files" << endl;
+	cout << " -f               is the file to load (coudl be used serveral times); .gz and .zst files are decompressed" << endl;
+	cout << " --path           is the path where to find csv input files (.csv, .csv.gz, .csv.zst)" << endl;
 	cout << " --input-sep      is the csv input separator" << endl;
 	cout << " --output-sep     is the csv output separator" << endl;
 	cout << " --output-file    is the output file" << endl;
+	cout << " --output-threads number of threads formatting the output file (0 = one per core, default: 1)" << endl;
+	cout << " --threads        number of worker threads (0 = one per core, default: 1)" << endl;
+	cout << " --decompress-threads threads decompressing the frames of a multi-frame .zst file (0 = one per core, default: 0)" << endl;
+	cout << " --io             how the plain files are read: auto, mmap, populate (mmap reading the pages of a window up front), pread or uring (io_uring) (default: auto)" << endl;
+	cout << " --io-depth       pread blocks (8 MiB) read ahead of the one parsed, or io_uring reads (2 MiB) in flight (default: 4)" << endl;
+	cout << " --window         MiB of a mapped file parsed before its pages are released, bounding the memory used (0 = never, default: 64)" << endl;
+	cout << " --drop-cache     also drop the parsed parts of the files from the page cache" << endl;
+	cout << " --prefetch       input files read ahead (their first 256 MiB) while the current one is aggregated (default: 1)" << endl;
+	cout << " --cache          directory of the columnar caches of the input files: written by the first run over a file, read by the next ones" << endl;
+	cout << " --chunk-size     minimum size in bytes of a file range given to a thread (default: 16777216)" << endl;
+	cout << " --groups-hint    expected number of groups, used to presize the aggregation tables" << endl;
+	cout << " --memory-limit   memory (MiB) for the aggregation tables: past it the groups are spilled to disk" << endl;
+	cout << " --spill-dir      is the directory for the spill files (default: the system temp directory)" << endl;
+	cout << " --decimal        sum-elements that are fixed point decimals, with the number of decimals ex.: --decimal \"4-6:3\"" << endl;
+	cout << " --double         sum-elements that are floating point numbers" << endl;
+	cout << " --kahan          compensated (Kahan) summation of the --double elements" << endl;
+	cout << " --radix-bits     split the rows in 2^N partitions by key hash before aggregating them, N up to 12 (default: 0, off)" << endl;
+	cout << " --batch-size     rows hashed and prefetched together before probing the table (0 = one at a time, default: 256)" << endl;
+	cout << " --dense-keys     integer keys in [0, N) go in a dense array without hashing: auto (sampled ranges), off or N (default: auto)" << endl;
+	cout << " --dict-keys      dictionary encode the repetitive key columns: auto (sampled), off or all (default: auto)" << endl;
 	cout << " --no-value       specify witch is the \"no value\" (default: \"-1\")" << endl;
 	cout << " --set-header     specify the header to use for the output csv" << endl;
 	cout << " --dry-run        execute some test on input parameter" << endl;
@@ -0,0 +1,284 @@
+#ifndef AGGREGATE_BLOCK_RING_H
+#define AGGREGATE_BLOCK_RING_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+/*
+ *  A bounded queue of blocks between a thread reading (or decompressing) an input file
+ *  and the one tokenizing it: the producer waits when it's full, and the consumed blocks
+ *  go back to the producer to be filled again.
+ *  LineBlocks cuts the bytes of the producer in blocks of whole lines, for the readers of
+ *  compressed.h and input.h.
+ */
+
+// the blocks between the producer and the consumer
+class BlockRing
+{
+public:
+	explicit BlockRing(size_t capacity) : _capacity(capacity) {}
+
+	// false when the consumer is gone
+	bool push(std::vector<char>&& block)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_not_full.wait(lock, [this]() { return _closed || _blocks.size() < _capacity; });
+		if (_closed)
+			return false;
+
+		_blocks.push_back(std::move(block));
+		_not_empty.notify_one();
+		return true;
+	}
+
+	// false when all the blocks have been consumed
+	bool pop(std::vector<char>& block)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_not_empty.wait(lock, [this]() { return _finished || !_blocks.empty(); });
+		if (_blocks.empty())
+			return false;
+
+		block = std::move(_blocks.front());
+		_blocks.pop_front();
+		_not_full.notify_one();
+		return true;
+	}
+
+	// the consumed blocks are given back to the producer, to be filled again
+	void recycle(std::vector<char>&& block)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_spares.size() < _capacity)
+			_spares.push_back(std::move(block));
+	}
+
+	// an empty block of at least size bytes
+	std::vector<char> spare(size_t size)
+	{
+		std::vector<char> block;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!_spares.empty())
+			{
+				block = std::move(_spares.back());
+				_spares.pop_back();
+			}
+		}
+		block.resize(std::max(size, block.capacity()));
+		return block;
+	}
+
+	// the producer has no more blocks
+	void finish()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_finished = true;
+		_not_empty.notify_all();
+	}
+
+	// the consumer wants no more blocks
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_closed = true;
+		_not_full.notify_all();
+	}
+
+	bool closed()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _closed;
+	}
+
+private:
+	const size_t _capacity;
+	std::mutex _mutex;
+	std::condition_variable _not_full;
+	std::condition_variable _not_empty;
+	std::deque<std::vector<char>> _blocks;
+	std::vector<std::vector<char>> _spares;
+	bool _finished{false};
+	bool _closed{false};
+};
+
+
+// the stream of bytes of a producer thread, queued in blocks of whole lines: a block is cut
+// after its last end of line when full, and its incomplete last line starts the next one.
+// With skip_first the bytes up to the first end of line are dropped, and only the lines
+// starting in the first limit bytes of the stream are queued.
+class LineBlocks
+{
+public:
+	LineBlocks(const std::string& fname, size_t block_size, size_t ring_size, bool skip_first = false, size_t limit = std::string::npos)
+		: _fname(fname)
+		, _block_size(block_size)
+		, _limit(limit)
+		, _ring(ring_size)
+		, _aligned(!skip_first)
+	{}
+
+	~LineBlocks() { stop(); }
+
+	// run the producer in its thread
+	void start(std::function<void()> produce)
+	{
+		_producer = std::thread([this, produce]() {
+			_out = _ring.spare(_block_size);
+			produce();
+			_ring.finish();
+		});
+	}
+
+	// the consumer is gone: wait for the producer to notice it
+	void stop()
+	{
+		_ring.close();
+		if (_producer.joinable())
+			_producer.join();
+	}
+
+	// the next block of whole lines (the last one may miss its end of line), valid until the next call
+	bool next(boost::string_view& block)
+	{
+		if (!_block.empty())
+			_ring.recycle(std::move(_block));
+		if (!_ring.pop(_block))
+			return false;
+
+		block = boost::string_view(_block.data(), _block.size());
+		return true;
+	}
+
+	// producer side: the n bytes after tail() are written directly
+	char* tail() { return _out.data() + _used; }
+	size_t room() const { return _out.size() - _used; }
+
+	// bytes of the stream received so far
+	size_t produced() const { return _queued + _used; }
+
+	// n bytes have been written after tail(); false when no more are needed, because the
+	// consumer is gone or the lines starting before the limit are all queued
+	bool filled(size_t n)
+	{
+		_used += n;
+		if (!_aligned)
+		{
+			const void* nl = memchr(_out.data(), '\n', _used);
+			const size_t s = (nl == nullptr) ? _used : static_cast<const char*>(nl) - _out.data() + 1;
+			std::memmove(_out.data(), _out.data() + s, _used - s);
+			_used -= s;
+			_queued += s;
+			_aligned = (nl != nullptr);
+			if (_queued >= _limit)
+				_over = true;
+		}
+
+		return !_over && (_used < _out.size() || cut());
+	}
+
+	// copy n bytes of data in the stream
+	bool append(const char* data, size_t n)
+	{
+		while (n > 0)
+		{
+			const size_t c = std::min(n, room());
+			std::memcpy(tail(), data, c);
+			data += c;
+			n -= c;
+			if (!filled(c))
+				return false;
+		}
+		return true;
+	}
+
+	// the stream is over: queue its last line
+	void flush()
+	{
+		if (!_over && _used > 0)
+			push(_used);
+	}
+
+	bool closed() { return _ring.closed(); }
+
+	[[noreturn]] void fail(const char* error) const
+	{
+		std::cerr << "Error reading " << _fname << ": " << error << std::endl;
+		exit(1);
+	}
+
+private:
+	bool cut()
+	{
+		const void* nl = memrchr(_out.data(), '\n', _used);
+		if (nl == nullptr)
+		{
+			// a line longer than the block
+			_out.resize(_out.size() * 2);
+			return true;
+		}
+
+		const size_t n = static_cast<const char*>(nl) - _out.data() + 1;
+		std::vector<char> next = _ring.spare(std::max(_block_size, 2 * (_used - n)));
+		std::memcpy(next.data(), _out.data() + n, _used - n);
+
+		if (!push(n))
+			return false;
+
+		_out = std::move(next);
+		_used -= n;
+		return true;
+	}
+
+	// queue the first n bytes of _out, but only the lines starting before the limit; false
+	// when the limit or the consumer is over, and nothing is queued after
+	bool push(size_t n)
+	{
+		bool more{true};
+		if (_queued >= _limit)
+		{
+			_over = true;
+			return false;
+		}
+		if (_queued + n > _limit)
+		{
+			const size_t from = _limit - _queued - 1;
+			const void* nl = memchr(_out.data() + from, '\n', n - from);
+			n = (nl == nullptr) ? n : static_cast<const char*>(nl) - _out.data() + 1;
+			more = false;
+		}
+
+		_out.resize(n);
+		_queued += n;
+		_over = !_ring.push(std::move(_out)) || !more;
+		return !_over;
+	}
+
+	const std::string _fname;
+	const size_t _block_size;
+	const size_t _limit;
+	BlockRing _ring;
+	std::thread _producer;
+
+	// producer side
+	std::vector<char> _out;
+	size_t _used{0};
+	size_t _queued{0};   // bytes of the stream before _out
+	bool _aligned;
+	bool _over{false};
+
+	// consumer side
+	std::vector<char> _block;
+};
+
+#endif
@@ -0,0 +1,777 @@
+#ifndef AGGREGATE_COLUMN_CACHE_H
+#define AGGREGATE_COLUMN_CACHE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/utility/string_view.hpp>
+#include <xxhash.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dense_keys.h"
+#include "flat_table.h"
+#include "tokenizer.h"
+
+/*
+ *  Columnar cache of the input files: with --cache the first run over a file writes all its
+ *  columns in a sidecar, and the next runs map the sidecar and read back only the columns
+ *  they need instead of tokenizing the text again.
+ *  The rows are stored in groups, each self-contained: in a group a column whose values are
+ *  all canonical integers (see DenseKeys::parse, so their text is exactly the one written
+ *  back) takes int32_t or int64_t values, the others their texts, with a dictionary of the
+ *  group when its few distinct texts make it smaller. The groups of the ranges of a file are
+ *  built by the threads in parallel, each with its own dictionaries.
+ *  The integers read as sums are given to the aggregator already parsed.
+ *  A sidecar is named from the hash of the file path, and it's used only for the same path,
+ *  size, modification time, separator and skipped lines.
+ *
+ *  sidecar: header_t, path, the groups, the index; every part is padded to 8 bytes
+ *  group: uint32_t fields of every row, then its columns (see kind_t)
+ *  index: group_t of every group in the order of the file, part_t of every column of every group
+ */
+
+class ColumnCache
+{
+public:
+	// a column of a group: int32_t or int64_t values; raw: uint32_t end offsets of the texts
+	// then the texts; dict16/32: uint32_t end offsets of the count texts of the dictionary,
+	// uint16_t/uint32_t codes, then the texts of the dictionary
+	enum kind_t : uint8_t { none, int32, int64, raw, dict16, dict32 };
+
+private:
+	struct header_t
+	{
+		char magic[8];
+		uint64_t size;          // of the file
+		int64_t mtime_sec;
+		int64_t mtime_nsec;
+		uint64_t skip_line;
+		uint64_t sep;
+		uint64_t path_size;
+		uint64_t columns;       // the most fields of a row
+		uint64_t groups;
+		uint64_t index;         // offset
+	};
+
+	struct group_t
+	{
+		uint64_t offset;
+		uint64_t rows;
+	};
+
+	struct part_t
+	{
+		uint64_t offset;
+		uint64_t size;
+		uint32_t kind;
+		uint32_t count;         // of the dictionary
+	};
+
+public:
+	class Writer;
+
+	size_t groups() const { return _groups.size(); }
+	size_t bytes() const { return _size; }
+
+	~ColumnCache()
+	{
+		if (_addr != nullptr)
+			munmap(_addr, _size);
+	}
+
+	// the sidecar of fname in dir
+	static std::string path_of(const std::string& dir, const std::string& fname)
+	{
+		const std::string p = boost::filesystem::absolute(fname).native();
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.colcache", static_cast<unsigned long long>(XXH3_64bits(p.data(), p.size())));
+		return (boost::filesystem::path(dir) / name).native();
+	}
+
+	// the sidecar of fname in dir, nullptr when there is none or it's stale or damaged
+	static std::unique_ptr<ColumnCache> open(const std::string& dir, const std::string& fname, char sep, size_t skip_line)
+	{
+		std::unique_ptr<ColumnCache> cache{new ColumnCache{}};
+		const std::string path = path_of(dir, fname);
+
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return nullptr;
+		struct stat sb;
+		if (fstat(fd, &sb) == 0 && static_cast<size_t>(sb.st_size) >= sizeof(header_t))
+		{
+			cache->_size = sb.st_size;
+			void* p = mmap(nullptr, cache->_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			cache->_addr = (p == MAP_FAILED) ? nullptr : static_cast<char*>(p);
+		}
+		close(fd);
+
+		if (cache->_addr == nullptr || !cache->load(fname, sep, skip_line))
+			return nullptr;
+		return cache;
+	}
+
+	// the rows of the groups [begin, end) as fun(row, values, parsed): the first needed fields
+	// of a row, where the with_text ones have their text (the others are empty), and the
+	// with_int ones are in values already parsed when parsed[c] (else they have their text)
+	template <typename F>
+	void replay(size_t begin, size_t end, const std::vector<bool>& with_text, const std::vector<bool>& with_int, F& fun) const
+	{
+		const size_t needed = with_text.size();
+		std::string buffer;
+		std::vector<uint32_t> ends;
+		std::vector<int64_t> values(needed);
+		std::vector<bool> parsed(needed, false);
+		std::vector<uint8_t> ops(needed, 0);
+		std::vector<column_view_t> columns(needed);
+		char number[24];
+
+		for (size_t g = begin; g < std::min(end, _groups.size()); g++)
+		{
+			const auto& group = _groups[g];
+			const uint32_t* fields = reinterpret_cast<const uint32_t*>(_addr + group.offset);
+
+			// what to do with every column in this group: only the ones used are read
+			prefault(_addr + group.offset, group.rows * sizeof(uint32_t));
+			for (size_t c = 0; c < std::min(needed, _width); c++)
+			{
+				const part_t& part = _parts[g * _width + c];
+				const bool integer = (part.kind == int32 || part.kind == int64);
+				parsed[c] = with_int[c] && integer;
+				ops[c] = (with_text[c] || (with_int[c] && !integer)) ? op_text : 0;
+				if (parsed[c])
+					ops[c] |= op_value;
+
+				columns[c] = (ops[c] != 0) ? column_of(part, group.rows) : column_view_t{};
+				prefault(_addr + part.offset, (ops[c] != 0) ? part.size : 0);
+			}
+
+			for (size_t r = 0; r < group.rows; r++)
+			{
+				const size_t n = std::min<size_t>({fields[r], needed, _width});
+				buffer.clear();
+				ends.clear();
+				for (size_t c = 0; c < n; c++)
+				{
+					const column_view_t& column = columns[c];
+					switch (column.kind)
+					{
+						case none:
+							break;
+						case int32:
+						case int64:
+						{
+							if (ops[c] == 0)
+								break;
+							int64_t v;
+							if (column.kind == int32)
+							{
+								int32_t w;
+								std::memcpy(&w, column.values + r * sizeof(w), sizeof(w));
+								v = w;
+							}
+							else
+								std::memcpy(&v, column.values + r * sizeof(v), sizeof(v));
+
+							values[c] = v;
+							if (ops[c] & op_text)
+							{
+								const auto e = std::to_chars(number, number + sizeof(number), v).ptr;
+								buffer.append(number, e - number);
+							}
+							break;
+						}
+						case raw:
+						case dict16:
+						case dict32:
+							if (ops[c] != 0)
+							{
+								const auto t = column.text(r);
+								buffer.append(t.data(), t.size());
+							}
+							break;
+					}
+					ends.push_back(static_cast<uint32_t>(buffer.size()));
+					buffer.push_back(_sep);
+				}
+
+				fun(row_t{buffer.data(), ends.data(), n}, values.data(), parsed);
+			}
+		}
+	}
+
+	// writes the sidecar of a file: its groups come from the Builders of its ranges, in any
+	// order, and finish() puts them back in the order of the file (thread safe)
+	class Writer
+	{
+	public:
+		Writer(const std::string& dir, const std::string& fname, char sep, size_t skip_line)
+			: _path(path_of(dir, fname))
+			, _tmp(_path + "." + std::to_string(getpid()) + ".tmp")
+		{
+			struct stat sb;
+			if (stat(fname.c_str(), &sb) != 0)
+				fail("cannot stat " + fname);
+
+			std::memcpy(_header.magic, magic, sizeof(_header.magic));
+			_header.size = sb.st_size;
+			_header.mtime_sec = sb.st_mtim.tv_sec;
+			_header.mtime_nsec = sb.st_mtim.tv_nsec;
+			_header.skip_line = skip_line;
+			_header.sep = static_cast<unsigned char>(sep);
+
+			const std::string fpath = boost::filesystem::absolute(fname).native();
+			_header.path_size = fpath.size();
+
+			_fd = ::open(_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (_fd < 0)
+				fail("cannot create cache file " + _tmp);
+
+			// the header is written again by finish()
+			std::string head(static_cast<const char*>(static_cast<const void*>(&_header)), sizeof(_header));
+			head += fpath;
+			head.resize(padded(head.size()), '\0');
+			write(head.data(), head.size(), 0);
+			_end = head.size();
+		}
+
+		~Writer()
+		{
+			if (_fd >= 0)
+			{
+				close(_fd);
+				std::remove(_tmp.c_str());
+			}
+		}
+
+		// a group of rows of the range starting at position, the seq-th one of its range: its
+		// parts have their offsets inside data
+		void add(size_t position, size_t seq, const std::vector<char>& data, size_t rows, std::vector<part_t> parts)
+		{
+			uint64_t offset;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				offset = _end;
+				_end += data.size();
+				for (auto& p : parts)
+					p.offset += offset;
+				_groups.push_back({position, seq, {offset, rows}, std::move(parts)});
+			}
+			write(data.data(), data.size(), offset);
+		}
+
+		// the sidecar is complete: it replaces the old one
+		void finish()
+		{
+			std::sort(_groups.begin(), _groups.end(), [](const pending_t& a, const pending_t& b) {
+				return std::make_pair(a.position, a.seq) < std::make_pair(b.position, b.seq);
+			});
+
+			size_t width{0};
+			for (const auto& g : _groups)
+				width = std::max(width, g.parts.size());
+
+			std::vector<group_t> groups;
+			std::vector<part_t> parts;
+			for (const auto& g : _groups)
+			{
+				groups.push_back(g.group);
+				parts.insert(parts.end(), g.parts.begin(), g.parts.end());
+				parts.resize(groups.size() * width, part_t{0, 0, none, 0});
+			}
+
+			_header.columns = width;
+			_header.groups = groups.size();
+			_header.index = _end;
+			write(groups.data(), groups.size() * sizeof(group_t), _end);
+			write(parts.data(), parts.size() * sizeof(part_t), _end + groups.size() * sizeof(group_t));
+			write(&_header, sizeof(_header), 0);
+
+			const int fd = _fd;
+			_fd = -1;
+			if (close(fd) != 0)
+				fail("cannot write cache file " + _tmp);
+			if (std::rename(_tmp.c_str(), _path.c_str()) != 0)
+				fail("cannot create cache file " + _path);
+		}
+
+	private:
+		struct pending_t
+		{
+			size_t position;
+			size_t seq;
+			group_t group;
+			std::vector<part_t> parts;
+		};
+
+		void write(const void* data, size_t size, uint64_t offset)
+		{
+			const char* p = static_cast<const char*>(data);
+			while (size > 0)
+			{
+				const ssize_t w = pwrite(_fd, p, size, offset);
+				if (w < 0 && errno == EINTR)
+					continue;
+				if (w <= 0)
+					fail("cannot write cache file " + _tmp);
+				p += w;
+				size -= w;
+				offset += w;
+			}
+		}
+
+		const std::string _path;
+		const std::string _tmp;
+		header_t _header{};
+		int _fd{-1};
+
+		std::mutex _mutex;
+		uint64_t _end{0};
+		std::vector<pending_t> _groups;
+	};
+
+	// cuts the rows of a range of the file (all the fields) in groups for the Writer: a group
+	// is at most group_rows rows or about group_bytes of columns
+	class Builder
+	{
+	public:
+		Builder(Writer& writer, size_t position, size_t group_bytes)
+			: _writer(writer)
+			, _position(position)
+			, _group_bytes(group_bytes)
+		{}
+
+		void operator()(const row_t& row)
+		{
+			const size_t n = row.size();
+			for (size_t c = _columns.size(); c < n; c++)
+			{
+				// a column missing in the previous rows of the group: they don't use it
+				_columns.emplace_back();
+				_columns.back().ints.resize(_fields.size(), 0);
+			}
+
+			for (size_t c = 0; c < _columns.size(); c++)
+			{
+				auto& column = _columns[c];
+				if (c >= n)
+				{
+					// past the fields of the row: never read back
+					column.skip();
+					continue;
+				}
+
+				const boost::string_view f = row[c];
+				int64_t v;
+				if (column.state == column_t::integer && DenseKeys::parse(f, v))
+					column.ints.push_back(v);
+				else
+					column.push(f);
+				_bytes += f.size() + sizeof(int64_t);
+			}
+
+			_fields.push_back(static_cast<uint32_t>(n));
+			if (_fields.size() == group_rows || _bytes >= _group_bytes)
+				flush();
+		}
+
+		// the range is over: its last group goes to the Writer
+		void finish() { flush(); }
+
+	private:
+		// a column of the group: integers, until a text comes; then texts with their dictionary,
+		// until it has too many of them to pay; then just the texts
+		struct column_t
+		{
+			enum state_t : uint8_t { integer, dictionary, plain };
+
+			state_t state{integer};
+			std::vector<int64_t> ints;
+
+			// dictionary
+			FlatTable table;
+			std::string distinct;
+			std::vector<uint32_t> distinct_ends;
+			std::vector<uint32_t> codes;
+			uint64_t plain_bytes{0};   // the size of the texts without the dictionary
+
+			// plain
+			std::string texts;
+			std::vector<uint32_t> ends;
+
+			size_t rows() const
+			{
+				return (state == integer) ? ints.size() : (state == dictionary) ? codes.size() : ends.size();
+			}
+
+			boost::string_view text(uint32_t code) const
+			{
+				const uint32_t b = (code == 0) ? 0 : distinct_ends[code - 1];
+				return boost::string_view(distinct.data() + b, distinct_ends[code] - b);
+			}
+
+			// a value that is not read back
+			void skip()
+			{
+				if (state == integer)
+					ints.push_back(0);
+				else
+					push(boost::string_view{});
+			}
+
+			void push(const boost::string_view& s)
+			{
+				if (state == integer)
+					to_dictionary();
+
+				if (state == dictionary)
+				{
+					const uint64_t h = XXH3_64bits(s.data(), s.size());
+					const auto r = table.insert(h, [this, &s](uint32_t i) { return text(i) == s; });
+					if (r.second)
+					{
+						distinct.append(s.data(), s.size());
+						distinct_ends.push_back(static_cast<uint32_t>(distinct.size()));
+					}
+					codes.push_back(r.first);
+					plain_bytes += s.size();
+
+					if (distinct_ends.size() > dictionary_min && distinct_ends.size() * 2 > codes.size())
+						to_plain();
+				}
+				else
+				{
+					texts.append(s.data(), s.size());
+					ends.push_back(static_cast<uint32_t>(texts.size()));
+				}
+			}
+
+			void to_dictionary()
+			{
+				char number[24];
+				state = dictionary;
+				for (const int64_t v : ints)
+				{
+					const auto e = std::to_chars(number, number + sizeof(number), v).ptr;
+					push(boost::string_view(number, e - number));
+				}
+				ints = std::vector<int64_t>{};
+			}
+
+			void to_plain()
+			{
+				for (const uint32_t code : codes)
+				{
+					const auto t = text(code);
+					texts.append(t.data(), t.size());
+					ends.push_back(static_cast<uint32_t>(texts.size()));
+				}
+				state = plain;
+				table = FlatTable{};
+				distinct = std::string{};
+				distinct_ends = std::vector<uint32_t>{};
+				codes = std::vector<uint32_t>{};
+			}
+		};
+
+		void flush()
+		{
+			if (_fields.empty())
+				return;
+
+			std::vector<char> data;
+			append(data, _fields.data(), _fields.size() * sizeof(uint32_t));
+
+			std::vector<part_t> parts;
+			for (auto& column : _columns)
+			{
+				part_t part{data.size(), 0, none, 0};
+				if (column.state == column_t::integer)
+				{
+					const auto r = std::minmax_element(column.ints.begin(), column.ints.end());
+					if (*r.first >= std::numeric_limits<int32_t>::min() && *r.second <= std::numeric_limits<int32_t>::max())
+					{
+						const std::vector<int32_t> narrow(column.ints.begin(), column.ints.end());
+						append(data, narrow.data(), narrow.size() * sizeof(int32_t));
+						part.kind = int32;
+					}
+					else
+					{
+						append(data, column.ints.data(), column.ints.size() * sizeof(int64_t));
+						part.kind = int64;
+					}
+				}
+				else
+				{
+					// the dictionary only when it's smaller than the texts
+					const size_t count = column.distinct_ends.size();
+					const size_t code_size = (count <= 0x10000) ? sizeof(uint16_t) : sizeof(uint32_t);
+					if (column.state == column_t::dictionary
+						&& count * sizeof(uint32_t) + column.codes.size() * code_size + column.distinct.size() >= column.codes.size() * sizeof(uint32_t) + column.plain_bytes)
+						column.to_plain();
+
+					if (column.state == column_t::dictionary)
+					{
+						append(data, column.distinct_ends.data(), count * sizeof(uint32_t), false);
+						if (code_size == sizeof(uint16_t))
+						{
+							const std::vector<uint16_t> narrow(column.codes.begin(), column.codes.end());
+							append(data, narrow.data(), narrow.size() * sizeof(uint16_t), false);
+						}
+						else
+							append(data, column.codes.data(), column.codes.size() * sizeof(uint32_t), false);
+						append(data, column.distinct.data(), column.distinct.size());
+						part.kind = (code_size == sizeof(uint16_t)) ? dict16 : dict32;
+						part.count = static_cast<uint32_t>(count);
+					}
+					else
+					{
+						append(data, column.ends.data(), column.ends.size() * sizeof(uint32_t), false);
+						append(data, column.texts.data(), column.texts.size());
+						part.kind = raw;
+					}
+				}
+
+				part.size = data.size() - part.offset;
+				parts.push_back(part);
+				column = column_t{};
+			}
+
+			_writer.add(_position, _seq++, data, _fields.size(), std::move(parts));
+			_fields.clear();
+			_bytes = 0;
+		}
+
+		// append size bytes to data, then pad it to 8 bytes
+		static void append(std::vector<char>& data, const void* p, size_t size, bool pad = true)
+		{
+			data.insert(data.end(), static_cast<const char*>(p), static_cast<const char*>(p) + size);
+			if (pad)
+				data.resize(padded(data.size()), 0);
+		}
+
+		constexpr static size_t group_rows{1024 * 1024};
+		// the distinct texts of a column kept in a dictionary while they are at most half of the rows
+		constexpr static size_t dictionary_min{4096};
+
+		Writer& _writer;
+		const size_t _position;
+		const size_t _group_bytes;
+		size_t _seq{0};
+
+		std::vector<column_t> _columns;
+		std::vector<uint32_t> _fields;
+		size_t _bytes{0};
+	};
+
+private:
+	// a column of a group while it's replayed: its offsets are clamped where they are read, so
+	// that even a damaged sidecar is never read out of its mapping
+	struct column_view_t
+	{
+		kind_t kind{none};
+		const char* values{nullptr};
+		const char* ends{nullptr};
+		const char* texts{nullptr};
+		uint32_t size{0};                     // of the texts
+		std::vector<boost::string_view> dictionary;
+
+		uint32_t end(size_t r) const
+		{
+			uint32_t e;
+			std::memcpy(&e, ends + r * sizeof(e), sizeof(e));
+			return std::min(e, size);
+		}
+
+		boost::string_view text(size_t r) const
+		{
+			if (kind == raw)
+			{
+				const uint32_t e = end(r);
+				const uint32_t b = std::min((r == 0) ? 0 : end(r - 1), e);
+				return boost::string_view(texts + b, e - b);
+			}
+
+			uint32_t code;
+			if (kind == dict16)
+			{
+				uint16_t c;
+				std::memcpy(&c, values + r * sizeof(c), sizeof(c));
+				code = c;
+			}
+			else
+				std::memcpy(&code, values + r * sizeof(code), sizeof(code));
+			return dictionary[std::min<size_t>(code, dictionary.size() - 1)];
+		}
+	};
+
+	column_view_t column_of(const part_t& part, size_t rows) const
+	{
+		column_view_t column;
+		column.kind = static_cast<kind_t>(part.kind);
+		const char* p = _addr + part.offset;
+		switch (column.kind)
+		{
+			case none:
+				break;
+			case int32:
+			case int64:
+				column.values = p;
+				break;
+			case raw:
+				column.ends = p;
+				column.texts = p + rows * sizeof(uint32_t);
+				column.size = static_cast<uint32_t>(std::min<uint64_t>(part.size - rows * sizeof(uint32_t), std::numeric_limits<uint32_t>::max()));
+				break;
+			case dict16:
+			case dict32:
+			{
+				const size_t code_size = (column.kind == dict16) ? sizeof(uint16_t) : sizeof(uint32_t);
+				column.ends = p;
+				column.values = p + part.count * sizeof(uint32_t);
+				column.texts = column.values + rows * code_size;
+				column.size = static_cast<uint32_t>(std::min<uint64_t>(part.size - part.count * sizeof(uint32_t) - rows * code_size, std::numeric_limits<uint32_t>::max()));
+				for (size_t i = 0; i < part.count; i++)
+				{
+					const uint32_t e = column.end(i);
+					const uint32_t b = std::min((i == 0) ? 0 : column.end(i - 1), e);
+					column.dictionary.emplace_back(column.texts + b, e - b);
+				}
+				break;
+			}
+		}
+		return column;
+	}
+
+	ColumnCache() = default;
+
+	static size_t padded(size_t n) { return (n + 7) & ~size_t{7}; }
+
+	static size_t page_size()
+	{
+		static const size_t size = sysconf(_SC_PAGESIZE);
+		return size;
+	}
+
+	// the pages of [p, p + n) are mapped at once rather than by a page fault each
+	static void prefault(const char* p, size_t n)
+	{
+#ifdef MADV_POPULATE_READ
+		constexpr int advice{MADV_POPULATE_READ};
+#else
+		constexpr int advice{MADV_WILLNEED};
+#endif
+		if (n == 0)
+			return;
+		const uintptr_t b = reinterpret_cast<uintptr_t>(p) & ~uintptr_t{page_size() - 1};
+		madvise(reinterpret_cast<void*>(b), reinterpret_cast<uintptr_t>(p) + n - b, advice);
+	}
+
+	// check the sidecar is the one of fname, and that all its parts are inside it
+	bool load(const std::string& fname, char sep, size_t skip_line)
+	{
+		header_t h;
+		std::memcpy(&h, _addr, sizeof(h));
+
+		struct stat sb;
+		const std::string fpath = boost::filesystem::absolute(fname).native();
+		if (std::memcmp(h.magic, magic, sizeof(h.magic)) != 0 || stat(fname.c_str(), &sb) != 0
+			|| h.size != static_cast<uint64_t>(sb.st_size) || h.mtime_sec != sb.st_mtim.tv_sec || h.mtime_nsec != sb.st_mtim.tv_nsec
+			|| h.skip_line != skip_line || h.sep != static_cast<unsigned char>(sep)
+			|| h.path_size != fpath.size() || sizeof(h) + h.path_size > _size || fpath.compare(0, fpath.size(), _addr + sizeof(h), h.path_size) != 0)
+			return false;
+
+		// the groups are in [data, index), the index up to the end
+		const uint64_t data = padded(sizeof(h) + h.path_size);
+		if (h.index < data || h.index % 8 != 0 || h.index > _size
+			|| h.groups > (_size - h.index) / sizeof(group_t)
+			|| (h.groups > 0 && h.columns > (_size - h.index - h.groups * sizeof(group_t)) / sizeof(part_t) / h.groups))
+			return false;
+
+		_sep = sep;
+		_width = h.columns;
+		const char* index = _addr + h.index;
+		_groups.resize(h.groups);
+		_parts.resize(h.groups * h.columns);
+		std::memcpy(_groups.data(), index, _groups.size() * sizeof(group_t));
+		std::memcpy(_parts.data(), index + _groups.size() * sizeof(group_t), _parts.size() * sizeof(part_t));
+
+		auto inside = [&h, data](uint64_t offset, uint64_t size) {
+			return offset >= data && offset % 8 == 0 && offset <= h.index && size <= h.index - offset;
+		};
+
+		for (size_t g = 0; g < _groups.size(); g++)
+		{
+			const uint64_t rows = _groups[g].rows;
+			if (rows > _size || !inside(_groups[g].offset, rows * sizeof(uint32_t)))
+				return false;
+
+			for (size_t c = 0; c < _width; c++)
+			{
+				const part_t& p = _parts[g * _width + c];
+				uint64_t least{0};
+				switch (p.kind)
+				{
+					case none:
+						continue;
+					case int32:
+						least = rows * sizeof(int32_t);
+						break;
+					case int64:
+						least = rows * sizeof(int64_t);
+						break;
+					case raw:
+						least = rows * sizeof(uint32_t);
+						break;
+					case dict16:
+					case dict32:
+						if (p.count == 0 && rows > 0)
+							return false;
+						least = p.count * uint64_t{sizeof(uint32_t)} + rows * (p.kind == dict16 ? sizeof(uint16_t) : sizeof(uint32_t));
+						break;
+					default:
+						return false;
+				}
+				if (!inside(p.offset, p.size) || p.size < least || ((p.kind == int32 || p.kind == int64) && p.size != padded(least)))
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	[[noreturn]] static void fail(const std::string& msg)
+	{
+		std::cerr << msg << std::endl;
+		exit(1);
+	}
+
+	constexpr static uint8_t op_text{1};
+	constexpr static uint8_t op_value{2};
+	constexpr static char magic[8]{'A', 'G', 'G', 'C', 'O', 'L', '0', '3'};
+
+	char* _addr{nullptr};
+	size_t _size{0};
+	char _sep{','};
+	size_t _width{0};
+
+	std::vector<group_t> _groups;
+	std::vector<part_t> _parts;   // _width of every group
+};
+
+#endif
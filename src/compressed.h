@@ -0,0 +1,274 @@
+#ifndef AGGREGATE_COMPRESSED_H
+#define AGGREGATE_COMPRESSED_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+#include "block_ring.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef AGGREGATE_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef AGGREGATE_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ *  Compressed input (.gz, .zst): a producer thread decompresses the file in large blocks,
+ *  cut after their last end of line, and queues them in a bounded ring while the tokenizer
+ *  consumes them, so every block holds whole lines.
+ *  The frames of a multi-frame zstd file are decompressed in parallel and queued in order.
+ *  gzip needs AGGREGATE_WITH_ZLIB and zstd AGGREGATE_WITH_ZSTD (see compile.sh).
+ */
+
+enum class compression_t { none, gzip, zstd };
+
+
+inline compression_t compression_of(const std::string& fname)
+{
+	auto ends_with = [&fname](const std::string& ext) {
+		return fname.size() >= ext.size() && fname.compare(fname.size() - ext.size(), ext.size(), ext) == 0;
+	};
+
+	if (ends_with(".gz"))
+		return compression_t::gzip;
+	if (ends_with(".zst"))
+		return compression_t::zstd;
+	return compression_t::none;
+}
+
+
+class CompressedReader
+{
+public:
+	// threads: decompressing the frames of a multi-frame zstd file
+	CompressedReader(const std::string& fname, size_t threads)
+		: _fname(fname)
+		, _threads(std::max<size_t>(1, threads))
+		, _lines(fname, block_size, ring_size)
+	{
+		_lines.start([this]() { produce(); });
+	}
+
+	~CompressedReader() { _lines.stop(); }
+
+	// the next block of whole lines (the last one may miss its end of line), valid until the next call
+	bool next(boost::string_view& block) { return _lines.next(block); }
+
+private:
+	void produce()
+	{
+		switch (compression_of(_fname))
+		{
+			case compression_t::gzip:
+#ifdef AGGREGATE_WITH_ZLIB
+				produce_gzip();
+#else
+				fail("gzip input is not supported by this build");
+#endif
+				break;
+			case compression_t::zstd:
+#ifdef AGGREGATE_WITH_ZSTD
+				produce_zstd();
+#else
+				fail("zstd input is not supported by this build");
+#endif
+				break;
+			case compression_t::none:
+				fail("not a compressed file");
+				break;
+		}
+	}
+
+#ifdef AGGREGATE_WITH_ZLIB
+	void produce_gzip()
+	{
+		gzFile f = gzopen(_fname.c_str(), "rb");
+		if (f == nullptr)
+			fail("can't open the file");
+		gzbuffer(f, 1024 * 1024);
+
+		for (;;)
+		{
+			const int r = gzread(f, _lines.tail(), static_cast<unsigned>(std::min<size_t>(_lines.room(), 1u << 30)));
+			if (r < 0)
+			{
+				int e;
+				fail(gzerror(f, &e));
+			}
+			if (r == 0 || !_lines.filled(r))
+				break;
+		}
+
+		gzclose(f);
+		_lines.flush();
+	}
+#endif
+
+#ifdef AGGREGATE_WITH_ZSTD
+	// decompress a whole frame (or several, one after the other) in out
+	void decompress(ZSTD_DCtx* ctx, const char* src, size_t n, std::vector<char>& out, size_t& used)
+	{
+		ZSTD_inBuffer in{src, n, 0};
+		bool full{true};
+		while (in.pos < in.size || full)
+		{
+			if (used == out.size())
+				out.resize(std::max(block_size, out.size() * 2));
+
+			ZSTD_outBuffer o{out.data() + used, out.size() - used, 0};
+			const size_t r = ZSTD_decompressStream(ctx, &o, &in);
+			if (ZSTD_isError(r))
+				fail(ZSTD_getErrorName(r));
+
+			used += o.pos;
+			full = (o.pos == o.size);
+		}
+	}
+
+	void produce_zstd()
+	{
+		const int fd = open(_fname.c_str(), O_RDONLY);
+		struct stat sb;
+		if (fd < 0 || fstat(fd, &sb) != 0)
+			fail("can't open the file");
+
+		const size_t size = sb.st_size;
+		void* addr = (size == 0) ? nullptr : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED)
+			fail("can't map the file");
+		const char* const data = static_cast<const char*>(addr);
+
+		// the frames of the file
+		std::vector<size_t> frames{0};
+		while (frames.back() < size)
+		{
+			const size_t n = ZSTD_findFrameCompressedSize(data + frames.back(), size - frames.back());
+			if (ZSTD_isError(n))
+				fail(ZSTD_getErrorName(n));
+			frames.push_back(frames.back() + n);
+		}
+
+		if (frames.size() <= 2 || _threads == 1)
+			produce_zstd_stream(data, size);
+		else
+			produce_zstd_frames(data, frames);
+
+		if (addr != nullptr)
+			munmap(addr, size);
+	}
+
+	// a frame at a time, in blocks
+	void produce_zstd_stream(const char* data, size_t size)
+	{
+		ZSTD_DCtx* ctx = ZSTD_createDCtx();
+		ZSTD_inBuffer in{data, size, 0};
+		bool full{true};
+		while (in.pos < in.size || full)
+		{
+			ZSTD_outBuffer o{_lines.tail(), _lines.room(), 0};
+			const size_t r = ZSTD_decompressStream(ctx, &o, &in);
+			if (ZSTD_isError(r))
+				fail(ZSTD_getErrorName(r));
+
+			full = (o.pos == o.size);
+			if (!_lines.filled(o.pos))
+				break;
+		}
+
+		ZSTD_freeDCtx(ctx);
+		_lines.flush();
+	}
+
+	// the frames are decompressed by _threads workers, at most window ahead of the one queued
+	void produce_zstd_frames(const char* data, const std::vector<size_t>& frames)
+	{
+		const size_t n = frames.size() - 1;
+		const size_t window = 2 * _threads;
+
+		struct frame_t
+		{
+			std::vector<char> out;
+			size_t used{0};
+			bool ready{false};
+		};
+		std::vector<frame_t> results(n);
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::atomic<size_t> next{0};
+		size_t queued{0};
+		bool stop{false};
+
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < std::min(_threads, n); t++)
+		{
+			workers.emplace_back([&, this]() {
+				ZSTD_DCtx* ctx = ZSTD_createDCtx();
+				for (size_t i = next++; i < n; i = next++)
+				{
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						cv.wait(lock, [&]() { return stop || i < queued + window; });
+						if (stop)
+							break;
+					}
+
+					frame_t f;
+					decompress(ctx, data + frames[i], frames[i + 1] - frames[i], f.out, f.used);
+
+					std::lock_guard<std::mutex> lock(mutex);
+					results[i] = std::move(f);
+					results[i].ready = true;
+					cv.notify_all();
+				}
+				ZSTD_freeDCtx(ctx);
+			});
+		}
+
+		for (size_t i = 0; i < n && !stop; i++)
+		{
+			frame_t f;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&]() { return results[i].ready; });
+				f = std::move(results[i]);
+			}
+
+			const bool ok = _lines.append(f.out.data(), f.used);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = !ok;
+			queued = i + 1;
+			cv.notify_all();
+		}
+
+		for (auto& w : workers)
+			w.join();
+		_lines.flush();
+	}
+#endif
+
+	[[noreturn]] void fail(const char* error) const { _lines.fail(error); }
+
+	constexpr static size_t block_size{4 * 1024 * 1024};
+	constexpr static size_t ring_size{4};
+
+	const std::string _fname;
+	const size_t _threads;
+	LineBlocks _lines;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef AGGREGATE_DENSE_KEYS_H
+#define AGGREGATE_DENSE_KEYS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+#include "tokenizer.h"
+
+/*
+ *  Keys made of small integers go straight to a slot of a dense array, without hashing
+ *  or probing: every key column has a range [lo, lo + width) and the slot is the mixed
+ *  radix number of the offsets of the fields inside their ranges.
+ *  Only the canonical text of a number ("7", not "07", "+7" or "-0") has a slot, so a
+ *  slot is always the same key text; out of range or other keys use the hash table.
+ */
+
+class DenseKeys
+{
+public:
+	struct range_t
+	{
+		int64_t lo;
+		uint64_t width;
+	};
+
+	DenseKeys() = default;
+	explicit DenseKeys(const std::vector<range_t>& ranges) : _ranges(ranges)
+	{
+		for (const auto& r : _ranges)
+			_slots *= r.width;
+	}
+
+	bool enabled() const { return !_ranges.empty(); }
+	size_t slots() const { return _slots; }
+
+	// the slot of the key of the row, false when the key has none
+	bool slot(const row_t& row, const std::vector<uint32_t>& columns, size_t& s) const
+	{
+		s = 0;
+		for (size_t i = 0; i < _ranges.size(); i++)
+		{
+			int64_t v;
+			if (!parse(row[columns[i]], v))
+				return false;
+
+			const uint64_t o = static_cast<uint64_t>(v) - static_cast<uint64_t>(_ranges[i].lo);
+			if (o >= _ranges[i].width)
+				return false;
+			s = s * _ranges[i].width + o;
+		}
+		return true;
+	}
+
+	// a canonical decimal integer of at most 18 digits
+	static bool parse(const boost::string_view& f, int64_t& v)
+	{
+		const bool negative = !f.empty() && f[0] == '-';
+		const size_t b = negative ? 1 : 0;
+		const size_t n = f.size() - b;
+
+		if (n == 0 || n > 18 || (f[b] == '0' && (n > 1 || negative)))
+			return false;
+
+		uint64_t u{0};
+		for (size_t i = b; i < f.size(); i++)
+		{
+			const unsigned d = static_cast<unsigned char>(f[i]) - '0';
+			if (d > 9)
+				return false;
+			u = u * 10 + d;
+		}
+
+		v = negative ? -static_cast<int64_t>(u) : static_cast<int64_t>(u);
+		return true;
+	}
+
+	// the same range [lo, lo + width) for every one of the n key columns, disabled past max_slots
+	static DenseKeys uniform(size_t n, int64_t lo, uint64_t width, size_t max_slots)
+	{
+		return DenseKeys::bounded(std::vector<range_t>(n, range_t{lo, width}), max_slots);
+	}
+
+	// the ranges of the keys seen in a sample of the rows
+	class Sampler
+	{
+	public:
+		explicit Sampler(const std::vector<uint32_t>& columns)
+			: _columns(columns)
+			, _lo(columns.size(), std::numeric_limits<int64_t>::max())
+			, _hi(columns.size(), std::numeric_limits<int64_t>::min())
+		{}
+
+		void operator()(const row_t& row)
+		{
+			for (size_t i = 0; i < _columns.size() && _ok; i++)
+			{
+				int64_t v;
+				if (_columns[i] >= row.size() || !parse(row[_columns[i]], v))
+					_ok = false;
+				else
+				{
+					_lo[i] = std::min(_lo[i], v);
+					_hi[i] = std::max(_hi[i], v);
+				}
+			}
+			_rows++;
+		}
+
+		// the sampled ranges with room for as many values again, disabled past max_slots
+		DenseKeys result(size_t max_slots) const
+		{
+			if (!_ok || _rows == 0)
+				return DenseKeys{};
+
+			std::vector<range_t> ranges;
+			for (size_t i = 0; i < _columns.size(); i++)
+			{
+				const uint64_t span = static_cast<uint64_t>(_hi[i]) - static_cast<uint64_t>(_lo[i]) + 1;
+				if (span > max_slots)
+					return DenseKeys{};
+
+				// ids and codes usually start near 0: then the range starts there
+				int64_t lo = _lo[i] - static_cast<int64_t>(span / 2);
+				if (_lo[i] >= 0 && lo < 0)
+					lo = 0;
+				ranges.push_back({lo, static_cast<uint64_t>(_hi[i] - lo) + 1 + span / 2});
+			}
+			return DenseKeys::bounded(ranges, max_slots);
+		}
+
+	private:
+		const std::vector<uint32_t>& _columns;
+		std::vector<int64_t> _lo;
+		std::vector<int64_t> _hi;
+		size_t _rows{0};
+		bool _ok{true};
+	};
+
+private:
+	static DenseKeys bounded(const std::vector<range_t>& ranges, size_t max_slots)
+	{
+		size_t slots{1};
+		for (const auto& r : ranges)
+		{
+			if (r.width == 0 || r.width > max_slots / slots)
+				return DenseKeys{};
+			slots *= r.width;
+		}
+		return DenseKeys{ranges};
+	}
+
+	std::vector<range_t> _ranges;
+	size_t _slots{1};
+};
+
+#endif
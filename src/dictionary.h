@@ -0,0 +1,306 @@
+#ifndef AGGREGATE_DICTIONARY_H
+#define AGGREGATE_DICTIONARY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+#include <xxhash.h>
+
+#include "flat_table.h"
+#include "key_arena.h"
+#include "tokenizer.h"
+
+/*
+ *  Dictionary encoding of the key columns: every distinct string of an encoded column gets
+ *  a small code shared by all the threads, and inside the key of a group the column takes
+ *  just its uint32_t code instead of (uint32_t length, bytes). The strings are looked up
+ *  again only to write the output.
+ *  Every thread has a cache of the codes it has met (KeyEncoder): the shared dictionary,
+ *  behind a mutex, is used only for the strings missing there.
+ *  A dictionary is closed when its column stops repeating (fewer than min_repeat rows for
+ *  every string) or when it outgrows its share of --memory-limit: its strings keep their
+ *  codes, the new ones stay as text (their length has the literal bit set).
+ */
+
+
+// the strings of a column, numbered in order of arrival
+class Dictionary
+{
+public:
+	constexpr static uint32_t npos{std::numeric_limits<uint32_t>::max()};
+	constexpr static uint32_t literal{uint32_t{1} << 31};
+
+	// a column is worth a dictionary when its strings are seen at least min_repeat times on average
+	constexpr static size_t min_repeat{4};
+
+	struct entry_t
+	{
+		uint32_t code;
+		boost::string_view text;   // owned by the dictionary
+	};
+
+	// budget: bytes the dictionary may take, 0 is no limit
+	explicit Dictionary(size_t budget = 0) : _budget(budget) {}
+
+	// the entry of s, added when new; once the dictionary is closed a new s gets npos.
+	// rows are the rows encoded by the caller since its last insert
+	entry_t insert(uint64_t h, const boost::string_view& s, size_t rows)
+	{
+		if (_closed.load(std::memory_order_acquire))
+			return find(h, s);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_closed.load(std::memory_order_relaxed))
+			return find(h, s);
+
+		_rows += rows;
+		const auto r = _table.insert(h, [this, &s](uint32_t i) {
+			return _texts[i] == s;
+		});
+		if (r.second)
+		{
+			char* p = _arena.allocate(s.size());
+			std::memcpy(p, s.data(), s.size());
+			_texts.emplace_back(p, s.size());
+			if (outgrown())
+				_closed.store(true, std::memory_order_release);
+		}
+		return {r.first, _texts[r.first]};
+	}
+
+	// only when no thread is inserting
+	const boost::string_view& text(uint32_t code) const { return _texts[code]; }
+
+private:
+	// a closed dictionary never changes, so it is read without the lock
+	entry_t find(uint64_t h, const boost::string_view& s) const
+	{
+		const auto i = _table.find(h, [this, &s](uint32_t j) {
+			return _texts[j] == s;
+		});
+		return i == FlatTable::npos ? entry_t{npos, {}} : entry_t{i, _texts[i]};
+	}
+
+	bool outgrown() const
+	{
+		const size_t n = _texts.size();
+		if (n >= literal - 1)
+			return true;
+		if (n >= min_entries && n * min_repeat > _rows)
+			return true;
+		return _budget != 0 && _table.memory() + _texts.capacity() * sizeof(boost::string_view) + _arena.memory() > _budget;
+	}
+
+	// a column is judged on its repeats only past min_entries strings
+	constexpr static size_t min_entries{64 * 1024};
+
+	std::mutex _mutex;
+	std::atomic<bool> _closed{false};
+	FlatTable _table;
+	std::vector<boost::string_view> _texts;
+	KeyArena _arena;
+	size_t _rows{0};
+	const size_t _budget;
+};
+
+
+// the dictionaries of the key columns (in the order of the -k list), nullptr for a column kept as text
+class KeyDictionary
+{
+public:
+	KeyDictionary() = default;
+	// budget: bytes all the dictionaries may take, 0 is no limit
+	explicit KeyDictionary(const std::vector<bool>& encoded, size_t budget = 0)
+	{
+		const size_t n = std::count(encoded.begin(), encoded.end(), true);
+		for (const bool e : encoded)
+		{
+			_columns.push_back(e ? std::make_unique<Dictionary>(budget / std::max<size_t>(n, 1)) : nullptr);
+			_enabled |= e;
+		}
+	}
+
+	bool enabled() const { return _enabled; }
+	size_t size() const { return _columns.size(); }
+	Dictionary* column(size_t i) const { return _columns[i].get(); }
+
+	// split a key back into its fields
+	void fields(const boost::string_view& key, std::vector<boost::string_view>& out) const
+	{
+		if (!_enabled)
+		{
+			key_fields(key, out);
+			return;
+		}
+
+		out.clear();
+		const char* p = key.data();
+		for (const auto& d : _columns)
+		{
+			uint32_t w;
+			std::memcpy(&w, p, sizeof(w));
+			p += sizeof(w);
+			if (d && (w & Dictionary::literal) == 0)
+				out.push_back(d->text(w));
+			else
+			{
+				if (d)
+					w &= ~Dictionary::literal;
+				out.emplace_back(p, w);
+				p += w;
+			}
+		}
+	}
+
+	// the columns repeating enough in a sample of the rows to be worth a dictionary
+	class Sampler
+	{
+	public:
+		explicit Sampler(const std::vector<uint32_t>& columns) : _columns(columns), _distinct(columns.size()) {}
+
+		void operator()(const row_t& row)
+		{
+			for (size_t i = 0; i < _columns.size(); i++)
+			{
+				if (_columns[i] < row.size())
+				{
+					const auto f = row[_columns[i]];
+					_distinct[i].emplace(f.data(), f.size());
+				}
+			}
+			_rows++;
+		}
+
+		// a column is encoded when its values are seen at least min_repeat times on average
+		std::vector<bool> result() const
+		{
+			std::vector<bool> encoded;
+			for (const auto& d : _distinct)
+				encoded.push_back(_rows > 0 && d.size() * Dictionary::min_repeat <= _rows);
+			return encoded;
+		}
+
+	private:
+		const std::vector<uint32_t>& _columns;
+		std::vector<std::unordered_set<std::string>> _distinct;
+		size_t _rows{0};
+	};
+
+private:
+	std::vector<std::unique_ptr<Dictionary>> _columns;
+	bool _enabled{false};
+};
+
+
+// builds the keys of the rows of a thread
+class KeyEncoder
+{
+public:
+	explicit KeyEncoder(const KeyDictionary* dict) : _dict(dict), _caches(dict == nullptr ? 0 : dict->size()) {}
+
+	// the key of the fields (in the order of columns) of row, valid until the next call, and its
+	// hash h: the hashes of the fields (of the codes for the encoded ones) are chained
+	boost::string_view encode(const row_t& row, const std::vector<uint32_t>& columns, uint64_t& h)
+	{
+		_buffer.clear();
+		h = 0;
+		for (size_t i = 0; i < columns.size(); i++)
+		{
+			const auto f = row[columns[i]];
+			Dictionary* d = _dict->column(i);
+
+			// a string missing from a closed dictionary stays as text, with the literal bit
+			uint64_t fh;
+			uint32_t w = d ? code(_caches[i], *d, f) : static_cast<uint32_t>(f.size());
+			if (w == Dictionary::npos)
+				w = static_cast<uint32_t>(f.size()) | Dictionary::literal;
+			_buffer.append(reinterpret_cast<const char*>(&w), sizeof(w));
+			if (d && (w & Dictionary::literal) == 0)
+				fh = ((static_cast<uint64_t>(i) << 32 | w) + 1) * 0xC2B2AE3D27D4EB4FULL;
+			else
+			{
+				_buffer.append(f.data(), f.size());
+				fh = XXH3_64bits_withSeed(f.data(), f.size(), i);
+			}
+			h = (i == 0) ? fh : hash_combine(h, fh);
+		}
+		return boost::string_view(_buffer.data(), _buffer.size());
+	}
+
+	// bytes of the caches
+	size_t memory() const
+	{
+		size_t n{0};
+		for (const auto& c : _caches)
+			n += c.front.size() * sizeof(cache_t::front_t) + c.table.memory() + c.entries.capacity() * sizeof(Dictionary::entry_t);
+		return n;
+	}
+
+	// forget the cached codes (they are in the dictionaries anyway)
+	void clear()
+	{
+		for (auto& c : _caches)
+			c = cache_t{};
+	}
+
+private:
+	// the codes met by the thread, the last ones also in a direct mapped front
+	struct cache_t
+	{
+		struct front_t
+		{
+			uint64_t hash{0};
+			Dictionary::entry_t entry{Dictionary::npos, {}};
+		};
+
+		std::vector<front_t> front{front_size};
+		FlatTable table;
+		std::vector<Dictionary::entry_t> entries;
+		size_t rows{0};   // encoded since the last insert in the dictionary
+	};
+
+	// the code of s, npos when s is not in the closed dictionary
+	static uint32_t code(cache_t& cache, Dictionary& d, const boost::string_view& s)
+	{
+		cache.rows++;
+		const uint64_t h = XXH3_64bits(s.data(), s.size());
+		auto& f = cache.front[h & (front_size - 1)];
+		if (f.hash == h && f.entry.text == s && f.entry.code != Dictionary::npos)
+			return f.entry.code;
+
+		const uint32_t i = cache.table.find(h, [&cache, &s](uint32_t j) {
+			return cache.entries[j].text == s;
+		});
+		if (i != FlatTable::npos)
+			f.entry = cache.entries[i];
+		else
+		{
+			const auto e = d.insert(h, s, cache.rows);
+			cache.rows = 0;
+			if (e.code == Dictionary::npos)
+				return e.code;
+
+			f.entry = e;
+			cache.table.insert(h, [](uint32_t) { return false; });
+			cache.entries.push_back(f.entry);
+		}
+		f.hash = h;
+		return f.entry.code;
+	}
+
+	constexpr static size_t front_size{256};
+
+	const KeyDictionary* _dict;
+	std::vector<cache_t> _caches;
+	std::string _buffer;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef AGGREGATE_FLAT_TABLE_H
+#define AGGREGATE_FLAT_TABLE_H
+
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+/*
+ *  Open addressing (linear probing) table from a 64 bit hash to the index of a group.
+ *  The hash is stored inline in the slot next to the index, so a lookup touches a single
+ *  cache line in the common case and never allocates. Since different keys can share a
+ *  hash, the caller's eq(index) tells if the group at index has really the looked up key.
+ */
+
+// chain the hash f of a field to the hash h of the fields before it
+inline uint64_t hash_combine(uint64_t h, uint64_t f)
+{
+	return (((h << 29) | (h >> 35)) * 0x9E3779B97F4A7C15ULL) ^ f;
+}
+
+
+class FlatTable
+{
+public:
+	constexpr static uint32_t npos{std::numeric_limits<uint32_t>::max()};
+
+	FlatTable() { reserve(0); }
+
+	size_t size() const { return _size; }
+	size_t memory() const { return _slots.size() * sizeof(slot_t); }
+
+	// make room for n groups without growing
+	void reserve(size_t n)
+	{
+		size_t c{min_capacity};
+		while (c * max_load_num < n * max_load_den)
+			c *= 2;
+
+		if (c > _slots.size())
+			rehash(c);
+	}
+
+	template <typename Eq>
+	uint32_t find(uint64_t h, Eq eq) const
+	{
+		for (size_t s = h & _mask; ; s = (s + 1) & _mask)
+		{
+			const slot_t& slot = _slots[s];
+			if (slot.index == npos)
+				return npos;
+			if (slot.hash == h && eq(slot.index))
+				return slot.index;
+		}
+	}
+
+	// start loading the first slot looked at for h
+	void prefetch(uint64_t h) const { __builtin_prefetch(&_slots[h & _mask]); }
+
+	// index of the group with hash h; a new group gets the next index (size() before the call)
+	template <typename Eq>
+	std::pair<uint32_t, bool> insert(uint64_t h, Eq eq)
+	{
+		if ((_size + 1) * max_load_den > _slots.size() * max_load_num)
+			rehash(_slots.size() * 2);
+
+		for (size_t s = h & _mask; ; s = (s + 1) & _mask)
+		{
+			slot_t& slot = _slots[s];
+			if (slot.index == npos)
+			{
+				slot.hash = h;
+				slot.index = static_cast<uint32_t>(_size++);
+				return std::make_pair(slot.index, true);
+			}
+			if (slot.hash == h && eq(slot.index))
+				return std::make_pair(slot.index, false);
+		}
+	}
+
+private:
+	struct slot_t
+	{
+		uint64_t hash{0};
+		uint32_t index{npos};
+	};
+
+	void rehash(size_t c)
+	{
+		std::vector<slot_t> old(c);
+		old.swap(_slots);
+		_mask = c - 1;
+
+		for (const auto& slot : old)
+		{
+			if (slot.index == npos)
+				continue;
+
+			size_t s = slot.hash & _mask;
+			while (_slots[s].index != npos)
+				s = (s + 1) & _mask;
+			_slots[s] = slot;
+		}
+	}
+
+	// grow when more than 3/4 of the slots are used. Tables start small: with radix partitions
+	// there is one for every partition, and most hold a few groups
+	constexpr static size_t max_load_num{3};
+	constexpr static size_t max_load_den{4};
+	constexpr static size_t min_capacity{16};
+
+	std::vector<slot_t> _slots;
+	size_t _mask{0};
+	size_t _size{0};
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef AGGREGATE_GROUPS_H
+#define AGGREGATE_GROUPS_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+#include "flat_table.h"
+#include "key_arena.h"
+#include "accumulators.h"
+
+/*
+ *  The groups found so far: the table maps the key hash to the group index inside
+ *  hashes/keys/sums, the key bytes live in the arena.
+ */
+
+struct groups_t
+{
+	groups_t() = default;
+	explicit groups_t(const slots_t& slots) : sums(slots) {}
+
+	FlatTable table;
+	std::vector<uint64_t> hashes;
+	std::vector<boost::string_view> keys;   // inside arena
+	SumTable sums;
+	KeyArena arena;
+
+	size_t size() const { return keys.size(); }
+
+	void reserve(size_t n)
+	{
+		table.reserve(n);
+		hashes.reserve(n);
+		keys.reserve(n);
+		sums.reserve(n);
+	}
+
+	// merge in the group (h, key, v, m); key is copied in the arena when the group is new and
+	// intern is true, otherwise it must already belong to the arena
+	void add(uint64_t h, const boost::string_view& key, const int64_t* v, const uint64_t* m, bool intern)
+	{
+		const auto r = table.insert(h, [this, &key](uint32_t i) {
+			return keys[i] == key;
+		});
+		if (!r.second)
+			sums.add(r.first, v, m);
+		else
+		{
+			hashes.push_back(h);
+			if (intern)
+			{
+				char* p = arena.allocate(key.size());
+				std::memcpy(p, key.data(), key.size());
+				keys.emplace_back(p, key.size());
+			}
+			else
+				keys.push_back(key);
+			sums.push(v, m);
+		}
+	}
+
+	// bytes used by the groups
+	size_t memory() const
+	{
+		return table.memory()
+			+ hashes.capacity() * sizeof(uint64_t)
+			+ keys.capacity() * sizeof(boost::string_view)
+			+ sums.memory()
+			+ arena.memory();
+	}
+};
+
+#endif
@@ -0,0 +1,487 @@
+#ifndef AGGREGATE_INPUT_H
+#define AGGREGATE_INPUT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+#include "block_ring.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#ifdef AGGREGATE_WITH_URING
+#include <linux/io_uring.h>
+#endif
+
+/*
+ *  How the plain input files are read:
+ *   - mmap: the file is mapped and read by page faults, with sequential readahead;
+ *   - populate: as mmap, but the pages are read up front, a --window at a time;
+ *   - pread: a thread reads large blocks while the previous one is parsed, and asks the
+ *     kernel to read ahead the next io_depth blocks, so that several reads are in flight;
+ *   - uring: as pread, but io_depth reads are queued to io_uring and copied in order as they
+ *     complete (needs AGGREGATE_WITH_URING, see compile.sh, and falls back to pread when the
+ *     kernel refuses io_uring).
+ *  auto uses pread on network filesystems, where page faults are slow round trips,
+ *  populate for small files and mmap for the others.
+ */
+
+enum class io_backend_t { automatic, mmap, populate, pread, uring };
+
+
+inline io_backend_t io_backend_of(const std::string& name)
+{
+	if (name == "auto")
+		return io_backend_t::automatic;
+	if (name == "mmap")
+		return io_backend_t::mmap;
+	if (name == "populate")
+		return io_backend_t::populate;
+	if (name == "pread")
+		return io_backend_t::pread;
+	if (name == "uring")
+		return io_backend_t::uring;
+
+	std::cerr << "Unknown I/O backend: " << name << std::endl;
+	exit(1);
+}
+
+
+// the backend for a file of fsize bytes
+inline io_backend_t choose_io(const std::string& fname, size_t fsize, io_backend_t io)
+{
+	constexpr size_t populate_max{256 * 1024 * 1024};
+
+	if (io != io_backend_t::automatic)
+		return io;
+
+	struct statfs sb;
+	if (statfs(fname.c_str(), &sb) == 0)
+	{
+		switch (static_cast<unsigned long>(sb.f_type))
+		{
+			case 0x6969:      // nfs
+			case 0x517B:      // smb
+			case 0xFE534D42:  // smb2
+			case 0xFF534D42:  // cifs
+			case 0x00C36400:  // ceph
+			case 0x65735546:  // fuse
+			case 0x47504653:  // gpfs
+			case 0x0BD00BD0:  // lustre
+				return io_backend_t::pread;
+			default:
+				break;
+		}
+	}
+
+	return (fsize <= populate_max) ? io_backend_t::populate : io_backend_t::mmap;
+}
+
+
+#ifdef AGGREGATE_WITH_URING
+// the few io_uring calls of the reader, with the raw system calls: reads are queued, submitted
+// together and completed in any order, tagged by their caller
+class Uring
+{
+public:
+	Uring() = default;
+	Uring(const Uring&) = delete;
+	Uring& operator=(const Uring&) = delete;
+
+	~Uring()
+	{
+		if (_sqes_map != MAP_FAILED)
+			munmap(_sqes_map, _sqes_size);
+		if (_cq_map != MAP_FAILED && _cq_map != _sq_map)
+			munmap(_cq_map, _cq_size);
+		if (_sq_map != MAP_FAILED)
+			munmap(_sq_map, _sq_size);
+		if (_fd >= 0)
+			close(_fd);
+	}
+
+	// room for entries reads in flight; false when the kernel has no io_uring or refuses it
+	bool setup(unsigned entries)
+	{
+		io_uring_params p;
+		std::memset(&p, 0, sizeof(p));
+		_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+		if (_fd < 0)
+			return false;
+
+		const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (single)
+			_sq_size = _cq_size = std::max(_sq_size, _cq_size);
+
+		_sq_map = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+		if (_sq_map == MAP_FAILED)
+			return false;
+		_cq_map = single ? _sq_map : mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+		if (_cq_map == MAP_FAILED)
+			return false;
+		_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+		_sqes_map = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+		if (_sqes_map == MAP_FAILED)
+			return false;
+
+		_sq_tail = at<unsigned>(_sq_map, p.sq_off.tail);
+		_sq_mask = *at<unsigned>(_sq_map, p.sq_off.ring_mask);
+		_sq_array = at<unsigned>(_sq_map, p.sq_off.array);
+		_sqes = static_cast<io_uring_sqe*>(_sqes_map);
+		_cq_head = at<unsigned>(_cq_map, p.cq_off.head);
+		_cq_tail = at<unsigned>(_cq_map, p.cq_off.tail);
+		_cq_mask = *at<unsigned>(_cq_map, p.cq_off.ring_mask);
+		_cqes = at<io_uring_cqe>(_cq_map, p.cq_off.cqes);
+		_iovecs.resize(entries);
+		return true;
+	}
+
+	// queue a read of n bytes at offset in buffer: the tags of the reads in flight must differ
+	// modulo entries
+	void read(int fd, char* buffer, size_t n, size_t offset, uint64_t tag)
+	{
+		iovec& v = _iovecs[tag % _iovecs.size()];
+		v.iov_base = buffer;
+		v.iov_len = n;
+
+		const unsigned tail = *_sq_tail;
+		const unsigned i = tail & _sq_mask;
+		io_uring_sqe& sqe = _sqes[i];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_READV;
+		sqe.fd = fd;
+		sqe.addr = reinterpret_cast<uint64_t>(&v);
+		sqe.len = 1;
+		sqe.off = offset;
+		sqe.user_data = tag;
+		_sq_array[i] = i;
+		__atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		_queued++;
+	}
+
+	// submit the queued reads and wait for a completion if wait; false (with errno) on error
+	bool enter(bool wait)
+	{
+		for (;;)
+		{
+			const long r = syscall(__NR_io_uring_enter, _fd, _queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				return false;
+
+			_queued -= static_cast<unsigned>(r);
+			return true;
+		}
+	}
+
+	// the next completed read: its tag and result (the bytes read, or -errno)
+	bool complete(uint64_t& tag, int& result)
+	{
+		const unsigned head = *_cq_head;
+		if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+			return false;
+
+		const io_uring_cqe& cqe = _cqes[head & _cq_mask];
+		tag = cqe.user_data;
+		result = cqe.res;
+		__atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+private:
+	template <typename T>
+	static T* at(void* map, size_t offset) { return static_cast<T*>(static_cast<void*>(static_cast<char*>(map) + offset)); }
+
+	int _fd{-1};
+	void* _sq_map{MAP_FAILED};
+	void* _cq_map{MAP_FAILED};
+	void* _sqes_map{MAP_FAILED};
+	size_t _sq_size{0};
+	size_t _cq_size{0};
+	size_t _sqes_size{0};
+
+	unsigned* _sq_tail{nullptr};
+	unsigned _sq_mask{0};
+	unsigned* _sq_array{nullptr};
+	io_uring_sqe* _sqes{nullptr};
+	unsigned* _cq_head{nullptr};
+	unsigned* _cq_tail{nullptr};
+	unsigned _cq_mask{0};
+	io_uring_cqe* _cqes{nullptr};
+
+	std::vector<iovec> _iovecs;   // of the reads in flight
+	unsigned _queued{0};          // not submitted yet
+};
+#endif
+
+
+// the lines starting inside [range_begin, range_end) of a file, read with pread (or io_uring)
+// in blocks of whole lines by a producer thread; with drop_cache the blocks read leave the
+// page cache
+class PreadReader
+{
+public:
+	PreadReader(const std::string& fname, size_t range_begin, size_t range_end, size_t depth, bool drop_cache = false, bool uring = false)
+		: _fname(fname)
+		, _range_begin(range_begin)
+		, _range_end(range_end)
+		, _depth(depth)
+		, _drop_cache(drop_cache)
+		// the stream starts at range_begin - 1: a range not at the file head starts after the
+		// first end of line found there
+		, _start((range_begin > 0) ? range_begin - 1 : 0)
+		, _lines(fname, block_size, ring_size, range_begin > 0, (range_end == std::string::npos) ? range_end : range_end - _start)
+	{
+		_lines.start([this, uring]() { produce(uring); });
+	}
+
+	~PreadReader() { _lines.stop(); }
+
+	bool at_file_head() const { return _range_begin == 0; }
+
+	// the next block of lines, valid until the next call
+	bool next(boost::string_view& block) { return _lines.next(block); }
+
+private:
+	void produce(bool uring)
+	{
+		const int fd = open(_fname.c_str(), O_RDONLY);
+		struct stat sb;
+		if (fd < 0 || fstat(fd, &sb) != 0)
+			_lines.fail(strerror(errno));
+
+		const size_t fsize = sb.st_size;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+#ifdef AGGREGATE_WITH_URING
+		if (!uring || !produce_uring(fd, fsize))
+#else
+		(void)uring;
+#endif
+			produce_pread(fd, fsize);
+
+		close(fd);
+		_lines.flush();
+	}
+
+	void produce_pread(int fd, size_t fsize)
+	{
+		size_t hinted = _start;
+		for (;;)
+		{
+			const size_t offset = _start + _lines.produced();
+			if (offset >= fsize)
+				return;
+			for (; _depth > 0 && hinted < std::min(fsize, offset + _depth * block_size); hinted += block_size)
+				posix_fadvise(fd, hinted, block_size, POSIX_FADV_WILLNEED);
+
+			const ssize_t r = pread(fd, _lines.tail(), _lines.room(), offset);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				_lines.fail(strerror(errno));
+			if (r == 0)
+				return;
+
+			if (_drop_cache)
+				posix_fadvise(fd, offset, r, POSIX_FADV_DONTNEED);
+			if (!_lines.filled(r))
+				return;
+		}
+	}
+
+#ifdef AGGREGATE_WITH_URING
+	// depth reads in flight, copied in order to the lines as they complete; false when the
+	// kernel refuses io_uring, before reading anything
+	bool produce_uring(int fd, size_t fsize)
+	{
+		const size_t n = std::max<size_t>(1, _depth);
+		Uring ring;
+		if (!ring.setup(static_cast<unsigned>(n)))
+			return false;
+
+		std::vector<std::vector<char>> buffers(n, std::vector<char>(read_size));
+		std::vector<int> results(n, 0);
+		std::vector<bool> ready(n, false);
+		auto offset = [this](size_t k) { return _start + k * read_size; };
+
+		// reads issued, completed by the kernel and copied to the lines; read k uses the
+		// buffer k % n
+		size_t issued{0};
+		size_t reaped{0};
+		size_t consumed{0};
+		bool more{true};
+		while (more)
+		{
+			// past the range, a read at a time while its last line goes on
+			while (issued < consumed + n && offset(issued) < fsize && (offset(issued) < _range_end || issued == consumed))
+			{
+				ring.read(fd, buffers[issued % n].data(), std::min(read_size, fsize - offset(issued)), offset(issued), issued);
+				issued++;
+			}
+			if (consumed == issued)
+				break;
+
+			if (!ring.enter(!ready[consumed % n]))
+				_lines.fail(strerror(errno));
+			uint64_t tag;
+			int result;
+			for (; ring.complete(tag, result); reaped++)
+			{
+				results[tag % n] = result;
+				ready[tag % n] = true;
+			}
+
+			for (; more && ready[consumed % n]; consumed++)
+			{
+				const size_t k = consumed % n;
+				const size_t o = offset(consumed);
+				const size_t length = std::min(read_size, fsize - o);
+				ready[k] = false;
+
+				// a short or failed read is completed with pread
+				size_t got = std::max(results[k], 0);
+				while (got < length)
+				{
+					const ssize_t r = pread(fd, buffers[k].data() + got, length - got, o + got);
+					if (r < 0 && errno == EINTR)
+						continue;
+					if (r < 0)
+						_lines.fail(strerror(errno));
+					if (r == 0)
+						break;
+					got += r;
+				}
+
+				if (_drop_cache)
+					posix_fadvise(fd, o, got, POSIX_FADV_DONTNEED);
+				more = _lines.append(buffers[k].data(), got) && got == length;
+			}
+		}
+
+		// the buffers must outlive the reads still in flight
+		uint64_t tag;
+		int result;
+		while (reaped < issued)
+		{
+			if (!ring.enter(true))
+				_lines.fail(strerror(errno));
+			for (; ring.complete(tag, result); reaped++)
+				;
+		}
+		return true;
+	}
+#endif
+
+	constexpr static size_t block_size{8 * 1024 * 1024};
+	// double buffering: a block is read while the other is parsed
+	constexpr static size_t ring_size{2};
+	// io_uring reads, depth of them in flight
+	constexpr static size_t read_size{2 * 1024 * 1024};
+
+	const std::string _fname;
+	const size_t _range_begin;
+	const size_t _range_end;
+	const size_t _depth;
+	const bool _drop_cache;
+	const size_t _start;
+	LineBlocks _lines;
+};
+
+
+// while a file is aggregated, a helper thread asks the kernel to read the start of the next
+// ahead files, so that they don't begin with a cold page cache; the files with an empty name
+// are not read ahead
+class Prefetcher
+{
+public:
+	Prefetcher(const std::vector<std::string>& fnames, size_t ahead) : _fnames(fnames), _ahead(ahead)
+	{
+		if (_ahead > 0 && _fnames.size() > 1)
+			_thread = std::thread([this]() { run(); });
+	}
+
+	~Prefetcher()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_cv.notify_one();
+		if (_thread.joinable())
+			_thread.join();
+	}
+
+	// file f is being read
+	void reading(size_t f)
+	{
+		if (!_thread.joinable())
+			return;
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (f + _ahead + 1 > _target)
+		{
+			_current = f;
+			_target = std::min(_fnames.size(), f + _ahead + 1);
+			_cv.notify_one();
+		}
+	}
+
+private:
+	void run()
+	{
+		// the first file is read right away: no time to win there
+		size_t next{1};
+		for (;;)
+		{
+			size_t f;
+			{
+				// the files already being read are skipped
+				std::unique_lock<std::mutex> lock(_mutex);
+				_cv.wait(lock, [this, next]() { return _stop || std::max(next, _current + 1) < _target; });
+				if (_stop)
+					return;
+				f = std::max(next, _current + 1);
+			}
+
+			const int fd = _fnames[f].empty() ? -1 : open(_fnames[f].c_str(), O_RDONLY);
+			struct stat sb;
+			if (fd >= 0 && fstat(fd, &sb) == 0)
+				posix_fadvise(fd, 0, std::min<size_t>(sb.st_size, prefetch_bytes), POSIX_FADV_WILLNEED);
+			if (fd >= 0)
+				close(fd);
+			next = f + 1;
+		}
+	}
+
+	// the first bytes of a file read ahead: more would be evicted before being used
+	constexpr static size_t prefetch_bytes{256 * 1024 * 1024};
+
+	const std::vector<std::string>& _fnames;
+	const size_t _ahead;
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	size_t _current{0};
+	size_t _target{1};
+	bool _stop{false};
+	std::thread _thread;
+};
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef AGGREGATE_KEY_ARENA_H
+#define AGGREGATE_KEY_ARENA_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+#include "tokenizer.h"
+
+/*
+ *  Storage for the keys of the groups: the key fields of a group are copied once in an
+ *  append-only arena as a sequence of (uint32_t length, bytes) and the group keeps a view
+ *  on them. Blocks never move, so the views stay valid until the arena is destroyed.
+ */
+
+class KeyArena
+{
+public:
+	char* allocate(size_t n)
+	{
+		if (n > _left)
+		{
+			// blocks double up to block_size, so an arena with a few keys stays small
+			const size_t b = std::max(n, _next);
+			_blocks.emplace_back(new char[b]);
+			_cur = _blocks.back().get();
+			_left = b;
+			_memory += b;
+			_next = std::min(block_size, _next * 2);
+		}
+
+		char* p = _cur;
+		_cur += n;
+		_left -= n;
+		return p;
+	}
+
+	// take the blocks of other: the keys stored there stay valid and are owned by this arena
+	void adopt(KeyArena& other)
+	{
+		std::move(other._blocks.begin(), other._blocks.end(), std::back_inserter(_blocks));
+		_memory += other._memory;
+		other._blocks.clear();
+		other._cur = nullptr;
+		other._left = 0;
+		other._memory = 0;
+	}
+
+	// bytes of the blocks
+	size_t memory() const { return _memory; }
+
+private:
+	constexpr static size_t first_block_size{256};
+	constexpr static size_t block_size{4 * 1024 * 1024};
+
+	std::vector<std::unique_ptr<char[]>> _blocks;
+	char* _cur{nullptr};
+	size_t _left{0};
+	size_t _memory{0};
+	size_t _next{first_block_size};
+};
+
+
+// size of the key made of the fields (in the order of columns) of row
+inline size_t key_size(const row_t& row, const std::vector<uint32_t>& columns)
+{
+	size_t n{0};
+	for (const auto c : columns)
+		n += sizeof(uint32_t) + row.at(c).size();
+	return n;
+}
+
+
+// write the key at dst (key_size bytes)
+inline void encode_key(char* dst, const row_t& row, const std::vector<uint32_t>& columns)
+{
+	for (const auto c : columns)
+	{
+		const auto f = row[c];
+		const uint32_t l = static_cast<uint32_t>(f.size());
+		std::memcpy(dst, &l, sizeof(l));
+		std::memcpy(dst + sizeof(l), f.data(), l);
+		dst += sizeof(l) + l;
+	}
+}
+
+
+// copy the key of row inside the arena
+inline boost::string_view intern_key(KeyArena& arena, const row_t& row, const std::vector<uint32_t>& columns)
+{
+	const size_t n = key_size(row, columns);
+	char* const key = arena.allocate(n);
+	encode_key(key, row, columns);
+	return boost::string_view(key, n);
+}
+
+
+inline bool key_equal(const boost::string_view& key, const row_t& row, const std::vector<uint32_t>& columns)
+{
+	const char* p = key.data();
+	for (const auto c : columns)
+	{
+		const auto f = row[c];
+		uint32_t l;
+		std::memcpy(&l, p, sizeof(l));
+		if (l != f.size() || std::memcmp(p + sizeof(l), f.data(), l) != 0)
+			return false;
+		p += sizeof(l) + l;
+	}
+
+	return true;
+}
+
+
+// split a key back into its fields
+inline void key_fields(const boost::string_view& key, std::vector<boost::string_view>& fields)
+{
+	fields.clear();
+	const char* p = key.data();
+	const char* const e = p + key.size();
+	while (p < e)
+	{
+		uint32_t l;
+		std::memcpy(&l, p, sizeof(l));
+		fields.emplace_back(p + sizeof(l), l);
+		p += sizeof(l) + l;
+	}
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef AGGREGATE_SIMD_H
+#define AGGREGATE_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ *  Byte scanning helpers: compare 64 bytes at once and walk the matches with tzcnt.
+ *  AVX2 is used when enabled at compile time, SSE2 otherwise (always there on x86-64).
+ *  The SWAR digit helpers assume a little endian target.
+ */
+
+namespace simd
+{
+
+constexpr size_t block_size{64};
+
+
+// bit i is set when p[i] == c
+inline uint64_t eq_mask(const char* p, char c)
+{
+#if defined(__AVX2__)
+	const __m256i vc = _mm256_set1_epi8(c);
+	const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+	const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+	const uint64_t lo = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, vc)));
+	const uint64_t hi = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, vc)));
+	return lo | (hi << 32);
+#elif defined(__SSE2__)
+	const __m128i vc = _mm_set1_epi8(c);
+	uint64_t m{};
+	for (int k = 0; k < 4; k++)
+	{
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * k));
+		m |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, vc)))) << (16 * k);
+	}
+	return m;
+#else
+	uint64_t m{};
+	for (size_t k = 0; k < block_size; k++)
+		m |= static_cast<uint64_t>(p[k] == c) << k;
+	return m;
+#endif
+}
+
+
+// like eq_mask, for two characters with a single load of the block
+inline void eq_masks(const char* p, char a, char b, uint64_t& ma, uint64_t& mb)
+{
+#if defined(__AVX2__)
+	const __m256i va = _mm256_set1_epi8(a);
+	const __m256i vb = _mm256_set1_epi8(b);
+	const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+	const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+	ma = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, va)))
+		| (static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, va)))) << 32);
+	mb = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vb)))
+		| (static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vb)))) << 32);
+#elif defined(__SSE2__)
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	ma = 0;
+	mb = 0;
+	for (int k = 0; k < 4; k++)
+	{
+		const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * k));
+		ma |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, va)))) << (16 * k);
+		mb |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, vb)))) << (16 * k);
+	}
+#else
+	ma = 0;
+	mb = 0;
+	for (size_t k = 0; k < block_size; k++)
+	{
+		ma |= static_cast<uint64_t>(p[k] == a) << k;
+		mb |= static_cast<uint64_t>(p[k] == b) << k;
+	}
+#endif
+}
+
+
+inline size_t first_bit(uint64_t m) { return static_cast<size_t>(__builtin_ctzll(m)); }
+
+
+// position of the first c inside [begin, end) or end
+inline size_t find(const char* data, size_t begin, size_t end, char c)
+{
+	size_t i = begin;
+	for (; i + block_size <= end; i += block_size)
+	{
+		const uint64_t m = eq_mask(data + i, c);
+		if (m != 0)
+			return i + first_bit(m);
+	}
+
+	for (; i < end; i++)
+		if (data[i] == c)
+			return i;
+
+	return end;
+}
+
+
+/*
+ *  SWAR digits: 8 ascii chars in a uint64_t (first char in the lowest byte) are checked
+ *  and converted at once.
+ */
+
+// the n (1 to 8) chars at p, padded on the left with '0'
+inline uint64_t load_digits(const char* p, size_t n)
+{
+	uint64_t c{0x3030303030303030};
+	std::memcpy(reinterpret_cast<char*>(&c) + (8 - n), p, n);
+	return c;
+}
+
+
+inline bool is_digits(uint64_t c)
+{
+	return ((c & 0xF0F0F0F0F0F0F0F0) | (((c + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) == 0x3333333333333333;
+}
+
+
+inline uint32_t digits_value(uint64_t c)
+{
+	c -= 0x3030303030303030;
+	c = (c * 10) + (c >> 8);
+	c = (((c & 0x000000FF000000FF) * (100 + (1000000ULL << 32))) + (((c >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >> 32;
+	return static_cast<uint32_t>(c);
+}
+
+}
+
+#endif
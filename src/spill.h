@@ -0,0 +1,182 @@
+#ifndef AGGREGATE_SPILL_H
+#define AGGREGATE_SPILL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+
+#include "groups.h"
+
+/*
+ *  Spill to disk: when the groups of a thread don't fit the memory limit they are written in a
+ *  run file, bucketed by partition (the top bits of the key hash), and the thread starts again
+ *  with an empty table. At the end every partition is read back from all the runs and
+ *  aggregated alone, so only 1/partitions of the groups are in memory at the same time.
+ *
+ *  run file: (partitions + 1) uint64_t offsets, then the records of each partition:
+ *  hash (uint64_t), key size (uint32_t), key bytes, sums (int64_t), validity bitmap (uint64_t)
+ */
+
+class Spill
+{
+public:
+	Spill(const std::string& dir, size_t partition_bits = 8)
+		: _dir(dir)
+		, _bits(partition_bits)
+		, _partitions(size_t{1} << partition_bits)
+	{}
+
+	~Spill()
+	{
+		for (const auto& r : _runs)
+			std::remove(r.c_str());
+	}
+
+	size_t partitions() const { return _partitions; }
+	size_t runs() const { std::lock_guard<std::mutex> lock{_mutex}; return _runs.size(); }
+	size_t partition(uint64_t h) const { return _bits == 0 ? 0 : h >> (64 - _bits); }
+
+	// write all the groups of parts in a new run (thread safe)
+	void write(const std::vector<groups_t>& parts)
+	{
+		const std::string fname = (boost::filesystem::path(_dir) / ("aggregate-" + std::to_string(getpid()) + "-" + std::to_string(_next_run++) + ".spill")).native();
+		const size_t width = parts.front().sums.width();
+		const size_t mask_width = parts.front().sums.mask_width();
+
+		// bucket the groups by partition
+		std::vector<uint64_t> offsets(_partitions + 1, 0);
+		std::vector<size_t> count(_partitions + 1, 0);
+		for (const auto& groups : parts)
+		{
+			for (size_t g = 0; g < groups.size(); g++)
+			{
+				const size_t p = partition(groups.hashes[g]);
+				offsets[p + 1] += record_size(groups.keys[g].size(), width, mask_width);
+				count[p + 1]++;
+			}
+		}
+
+		for (size_t p = 0; p < _partitions; p++)
+		{
+			offsets[p + 1] += offsets[p];
+			count[p + 1] += count[p];
+		}
+
+		// (part, group) in partition order
+		std::vector<std::pair<uint32_t, uint32_t>> order(count[_partitions]);
+		for (size_t i = 0; i < parts.size(); i++)
+			for (size_t g = 0; g < parts[i].size(); g++)
+				order[count[partition(parts[i].hashes[g])]++] = std::make_pair(static_cast<uint32_t>(i), static_cast<uint32_t>(g));
+
+		FILE* f = std::fopen(fname.c_str(), "wb");
+		if (f == nullptr)
+			fail("cannot create spill file " + fname);
+		std::vector<char> buffer(io_buffer);
+		setvbuf(f, buffer.data(), _IOFBF, buffer.size());
+
+		std::vector<int64_t> values(width);
+		std::vector<uint64_t> mask(mask_width);
+		bool ok = std::fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), f) == offsets.size();
+		for (const auto& o : order)
+		{
+			const auto& groups = parts[o.first];
+			const size_t g = o.second;
+			const uint64_t h = groups.hashes[g];
+			const auto& key = groups.keys[g];
+			const uint32_t l = static_cast<uint32_t>(key.size());
+			groups.sums.get(g, values.data(), mask.data());
+
+			ok = ok
+				&& std::fwrite(&h, sizeof(h), 1, f) == 1
+				&& std::fwrite(&l, sizeof(l), 1, f) == 1
+				&& std::fwrite(key.data(), 1, l, f) == l
+				&& std::fwrite(values.data(), sizeof(int64_t), width, f) == width
+				&& std::fwrite(mask.data(), sizeof(uint64_t), mask_width, f) == mask_width;
+		}
+
+		if (std::fclose(f) != 0 || !ok)
+			fail("cannot write spill file " + fname);
+
+		std::lock_guard<std::mutex> lock{_mutex};
+		_runs.push_back(fname);
+	}
+
+	// aggregate in groups the partition p of all the runs
+	void read(size_t p, groups_t& groups) const
+	{
+		const size_t width = groups.sums.width();
+		const size_t mask_width = groups.sums.mask_width();
+		std::vector<char> buffer;
+		std::vector<int64_t> values(width);
+		std::vector<uint64_t> mask(mask_width);
+
+		for (const auto& fname : _runs)
+		{
+			FILE* f = std::fopen(fname.c_str(), "rb");
+			if (f == nullptr)
+				fail("cannot open spill file " + fname);
+
+			uint64_t range[2];
+			const long header = static_cast<long>((_partitions + 1) * sizeof(uint64_t));
+			bool ok = std::fseek(f, static_cast<long>(p * sizeof(uint64_t)), SEEK_SET) == 0
+				&& std::fread(range, sizeof(uint64_t), 2, f) == 2
+				&& std::fseek(f, header + static_cast<long>(range[0]), SEEK_SET) == 0;
+
+			if (ok)
+			{
+				buffer.resize(range[1] - range[0]);
+				ok = std::fread(buffer.data(), 1, buffer.size(), f) == buffer.size();
+			}
+			std::fclose(f);
+			if (!ok)
+				fail("cannot read spill file " + fname);
+
+			for (const char* r = buffer.data(); r < buffer.data() + buffer.size(); )
+			{
+				uint64_t h;
+				uint32_t l;
+				std::memcpy(&h, r, sizeof(h));
+				std::memcpy(&l, r + sizeof(h), sizeof(l));
+				const char* key = r + sizeof(h) + sizeof(l);
+				std::memcpy(values.data(), key + l, width * sizeof(int64_t));
+				std::memcpy(mask.data(), key + l + width * sizeof(int64_t), mask_width * sizeof(uint64_t));
+
+				groups.add(h, boost::string_view(key, l), values.data(), mask.data(), true);
+				r += record_size(l, width, mask_width);
+			}
+		}
+	}
+
+private:
+	static size_t record_size(size_t key_size, size_t width, size_t mask_width)
+	{
+		return sizeof(uint64_t) + sizeof(uint32_t) + key_size + width * sizeof(int64_t) + mask_width * sizeof(uint64_t);
+	}
+
+	[[noreturn]] static void fail(const std::string& msg)
+	{
+		std::cerr << msg << std::endl;
+		exit(1);
+	}
+
+	constexpr static size_t io_buffer{1024 * 1024};
+
+	const std::string _dir;
+	const size_t _bits;
+	const size_t _partitions;
+
+	std::atomic<size_t> _next_run{0};
+	mutable std::mutex _mutex;
+	std::vector<std::string> _runs;
+};
+
+#endif
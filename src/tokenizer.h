@@ -0,0 +1,149 @@
+#ifndef AGGREGATE_TOKENIZER_H
+#define AGGREGATE_TOKENIZER_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+#include "simd.h"
+
+/*
+ *  CSV tokenizer: a single pass over the buffer finds both separators and end of lines,
+ *  64 bytes at a time, and calls fun with the fields of every (non empty) row.
+ *  When only the first needed fields are used, the rest of every line is skipped looking
+ *  just for its end: the row then has needed + 1 fields, the last one being the remainder.
+ */
+
+
+// view over the fields of a row: ends[i] is the offset (from the row start) where field i ends
+class row_t
+{
+public:
+	row_t(const char* row, const uint32_t* ends, size_t n) : _row(row), _ends(ends), _n(n) {}
+
+	size_t size() const { return _n; }
+
+	boost::string_view operator[](size_t i) const
+	{
+		const uint32_t b = (i == 0) ? 0 : _ends[i - 1] + 1;
+		return boost::string_view(_row + b, _ends[i] - b);
+	}
+
+	boost::string_view at(size_t i) const
+	{
+		if (i >= _n)
+			throw std::out_of_range("row_t: field " + std::to_string(i) + " out of range");
+		return (*this)[i];
+	}
+
+private:
+	const char* _row;
+	const uint32_t* _ends;
+	size_t _n;
+};
+
+
+class Tokenizer
+{
+public:
+	// past the needed fields (0 = all) the rest of the line is skipped
+	Tokenizer(char sep, size_t needed = 0) : _sep(sep), _needed(needed == 0 ? npos : needed) {}
+
+	// tokenize the rows of data starting before stop; returns the position after the last row.
+	// ends is the caller buffer for the field offsets: it's reused for every row
+	template <typename F>
+	size_t tokenize(const char* data, size_t size, size_t stop, std::vector<uint32_t>& ends, F& fun) const
+	{
+		size_t row{0};
+		ends.clear();
+
+		size_t i{0};
+		while (i + simd::block_size <= size)
+		{
+			uint64_t m_sep, m_end;
+			simd::eq_masks(data + i, _sep, end_line, m_sep, m_end);
+
+			size_t next = i + simd::block_size;
+			uint64_t m = m_sep | m_end;
+			while (m != 0)
+			{
+				const size_t b = simd::first_bit(m);
+				const size_t pos = i + b;
+				m &= m - 1;
+
+				if (m_end & (uint64_t{1} << b))
+				{
+					end_row(data, row, pos, ends, fun);
+					if (row >= stop)
+						return row;
+				}
+				else
+				{
+					ends.push_back(static_cast<uint32_t>(pos - row));
+					if (ends.size() == _needed)
+					{
+						// all the needed fields are there: go to the end of the line
+						const uint64_t m_next = (b + 1 < simd::block_size) ? (m_end & (~uint64_t{0} << (b + 1))) : 0;
+						if (m_next == 0)
+						{
+							next = simd::find(data, i + simd::block_size, size, end_line);
+							break;
+						}
+						m = (m_sep | m_end) & (~uint64_t{0} << simd::first_bit(m_next));
+					}
+				}
+			}
+
+			i = next;
+		}
+
+		for (; i < size; i++)
+		{
+			if (data[i] == end_line)
+			{
+				end_row(data, row, i, ends, fun);
+				if (row >= stop)
+					return row;
+			}
+			else if (data[i] == _sep)
+			{
+				ends.push_back(static_cast<uint32_t>(i - row));
+				if (ends.size() == _needed)
+					i = simd::find(data, i + 1, size, end_line) - 1;
+			}
+		}
+
+		// last line without end_line
+		if (row < size)
+		{
+			end_row(data, row, size, ends, fun);
+			return size;
+		}
+
+		return row;
+	}
+
+private:
+	template <typename F>
+	inline void end_row(const char* data, size_t& row, size_t pos, std::vector<uint32_t>& ends, F& fun) const
+	{
+		if (pos > row)
+		{
+			ends.push_back(static_cast<uint32_t>(pos - row));
+			fun(row_t{data + row, ends.data(), ends.size()});
+		}
+
+		ends.clear();
+		row = pos + 1;
+	}
+
+	constexpr static size_t npos{static_cast<size_t>(-1)};
+
+	const char _sep;
+	const size_t _needed;
+	constexpr const static char end_line{'\n'};
+};
+
+#endif
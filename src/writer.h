@@ -0,0 +1,253 @@
+#ifndef AGGREGATE_WRITER_H
+#define AGGREGATE_WRITER_H
+
+#include <algorithm>
+#include <charconv>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <boost/utility/string_view.hpp>
+
+#include "groups.h"
+
+/*
+ *  Output engine: rows are formatted (integers with std::to_chars) in a large buffer that goes
+ *  to the file with write(2), or pwrite(2) at a given offset when several threads write
+ *  different slices of the same file.
+ */
+
+class OutBuffer
+{
+public:
+	// offset < 0: sequential write(2), otherwise pwrite(2) starting at offset
+	OutBuffer(int fd, int64_t offset = -1, size_t capacity = 1024 * 1024)
+		: _fd(fd)
+		, _offset(offset)
+		, _capacity(capacity)
+		, _buffer(new char[capacity])
+	{}
+
+	~OutBuffer() { flush(); }
+
+	void append(const char* p, size_t n)
+	{
+		if (n > _capacity - _used)
+		{
+			flush();
+			if (n > _capacity)
+			{
+				write_all(p, n);
+				return;
+			}
+		}
+
+		std::memcpy(_buffer.get() + _used, p, n);
+		_used += n;
+	}
+
+	void append(const boost::string_view& s) { append(s.data(), s.size()); }
+
+	void append(char c)
+	{
+		if (_used == _capacity)
+			flush();
+		_buffer[_used++] = c;
+	}
+
+	void append(int64_t v)
+	{
+		if (_capacity - _used < max_int_chars)
+			flush();
+		const auto r = std::to_chars(_buffer.get() + _used, _buffer.get() + _capacity, v);
+		_used = r.ptr - _buffer.get();
+	}
+
+	void append(double v)
+	{
+		if (_capacity - _used < max_double_chars)
+			flush();
+		const auto r = std::to_chars(_buffer.get() + _used, _buffer.get() + _capacity, v);
+		_used = r.ptr - _buffer.get();
+	}
+
+	void flush()
+	{
+		write_all(_buffer.get(), _used);
+		_used = 0;
+	}
+
+private:
+	void write_all(const char* p, size_t n)
+	{
+		while (n > 0)
+		{
+			const ssize_t w = (_offset < 0) ? ::write(_fd, p, n) : ::pwrite(_fd, p, n, _offset);
+			if (w < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				std::cerr << "Output write error: " << strerror(errno) << std::endl;
+				exit(1);
+			}
+
+			p += w;
+			n -= w;
+			if (_offset >= 0)
+				_offset += w;
+		}
+	}
+
+	constexpr static size_t max_int_chars{20};
+	constexpr static size_t max_double_chars{32};
+
+	const int _fd;
+	int64_t _offset;
+	const size_t _capacity;
+	std::unique_ptr<char[]> _buffer;
+	size_t _used{0};
+};
+
+
+// number of chars of v in base 10
+inline size_t chars_length(int64_t v)
+{
+	uint64_t u = (v < 0) ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+	size_t n = (v < 0) ? 2 : 1;
+	for (; u >= 10; u /= 10)
+		n++;
+	return n;
+}
+
+
+constexpr size_t max_fixed_chars{24};
+
+
+inline int64_t power10(unsigned n)
+{
+	int64_t p{1};
+	while (n-- > 0)
+		p *= 10;
+	return p;
+}
+
+
+// write v / 10^scale at dst with scale decimals (max_fixed_chars at most); returns the length
+inline size_t format_fixed(char* dst, int64_t v, unsigned scale)
+{
+	const uint64_t u = (v < 0) ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+	const uint64_t p = static_cast<uint64_t>(power10(scale));
+
+	char* d = dst;
+	if (v < 0)
+		*d++ = '-';
+	d = std::to_chars(d, dst + max_fixed_chars, u / p).ptr;
+	if (scale > 0)
+	{
+		*d++ = '.';
+		uint64_t f = u % p;
+		for (size_t i = scale; i-- > 0; f /= 10)
+			d[i] = static_cast<char>('0' + f % 10);
+		d += scale;
+	}
+	return d - dst;
+}
+
+
+// number of chars of v in its shortest form
+inline size_t chars_length(double v)
+{
+	char b[32];
+	return std::to_chars(b, b + sizeof(b), v).ptr - b;
+}
+
+
+// groups [begin, end) of a table
+struct slice_t
+{
+	const groups_t* groups;
+	size_t begin;
+	size_t end;
+};
+
+
+// cut the tables in slices of about n groups
+inline std::vector<slice_t> get_slices(const std::vector<const groups_t*>& tables, size_t n)
+{
+	std::vector<slice_t> slices;
+	n = std::max<size_t>(n, 1);
+	for (const auto t : tables)
+		for (size_t b = 0; b < t->size(); b += n)
+			slices.push_back({t, b, std::min(b + n, t->size())});
+	return slices;
+}
+
+
+/*
+ *  write the rows of the slices at offset of fd; returns the offset after them.
+ *  The formatter (copied by every thread) gives the length of a row and writes it:
+ *    size_t length(const groups_t&, size_t g), void format(OutBuffer&, const groups_t&, size_t g)
+ *  With threads > 1 the length of every slice is computed first, then each thread writes
+ *  its slices at their own offset.
+ */
+template <typename F>
+size_t write_rows(int fd, size_t offset, const std::vector<slice_t>& slices, const F& formatter, size_t threads)
+{
+	if (threads <= 1 || slices.size() <= 1)
+	{
+		F fmt{formatter};
+		OutBuffer out{fd};
+		for (const auto& s : slices)
+			for (size_t g = s.begin; g < s.end; g++)
+				fmt.format(out, *s.groups, g);
+		out.flush();
+
+		const off_t pos = lseek(fd, 0, SEEK_CUR);
+		return pos < 0 ? offset : static_cast<size_t>(pos);
+	}
+
+	threads = std::min(threads, slices.size());
+	auto for_slices = [&slices, threads](auto fun) {
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++)
+		{
+			workers.emplace_back([&slices, &fun, threads, t]() {
+				for (size_t i = t; i < slices.size(); i += threads)
+					fun(i);
+			});
+		}
+		for (auto& w : workers)
+			w.join();
+	};
+
+	// offset of every slice
+	std::vector<size_t> offsets(slices.size() + 1, 0);
+	for_slices([&](size_t i) {
+		F fmt{formatter};
+		size_t n{0};
+		for (size_t g = slices[i].begin; g < slices[i].end; g++)
+			n += fmt.length(*slices[i].groups, g);
+		offsets[i + 1] = n;
+	});
+
+	offsets[0] = offset;
+	for (size_t i = 0; i < slices.size(); i++)
+		offsets[i + 1] += offsets[i];
+
+	for_slices([&](size_t i) {
+		F fmt{formatter};
+		OutBuffer out{fd, static_cast<int64_t>(offsets[i])};
+		for (size_t g = slices[i].begin; g < slices[i].end; g++)
+			fmt.format(out, *slices[i].groups, g);
+	});
+
+	lseek(fd, static_cast<off_t>(offsets.back()), SEEK_SET);
+	return offsets.back();
+}
+
+#endif